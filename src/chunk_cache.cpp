@@ -0,0 +1,350 @@
+/* Test a chunk cache that is shared by all children of a wrapper matrix, using the wrapper classes from `devirtualize_class.cpp`.
+ * This is based on the chunk caches in the [tatami_chunked](https://github.com/tatami-inc/tatami_chunked) library,
+ * where each child normally has its own cache, so `N` threads that access the same chunk would each need to decode it separately.
+ * Here, the cache is owned by `ActualWrapperParent` and each `ActualWrapperChild` refers to it, so a chunk that is decoded by one thread can be reused by all others.
+ *
+ * The cache is split into shards by chunk ID, and each shard has a fixed number of slots that hold pointers to immutable chunks.
+ * Lookups are lock-free: a child scans the slots in the shard for the chunk ID and sets the slot's reference bit if it finds it.
+ * On a miss, the child decodes the chunk without holding any lock, and then inserts it under the shard's spinlock (as in `hnsw_spinlock.cpp`),
+ * using the CLOCK algorithm to choose a victim, i.e., the hand skips (and clears the reference bit of) any recently used slots.
+ * Evicted chunks are reclaimed with epoch-based reclamation: each child announces the global epoch when it starts a lookup, and clears it when it is done with the chunk.
+ * An evicted chunk is only freed once all children that were active at the time of eviction have finished, so a reader never sees a freed chunk.
+ * At most `MAX_READERS` children can use the same cache at once, and creating any more will throw an exception.
+ *
+ * The question is how much the lock-free lookup costs on a hit, which is the common case that we want to be fast.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the acquire loads of the slot pointers are plain `mov`s,
+ * and the reference bit is only written (with a plain `movb`) on the out-of-line path where it was not already set, so repeated hits on a hot chunk do not write to its slot.
+ * However, announcing the epoch needs a `seq_cst` fence between the store of the epoch and the loads of the slots, which compiles to `lock orq $0, (%rsp)` and acts as a full barrier.
+ * (A `seq_cst` store alone would compile to `xchgq`, but this is not enough in the C++ memory model, as a later acquire load could still be reordered before it.)
+ * This costs a few dozen cycles on each `wrapped_fetch()`, so a real implementation would announce the epoch once for a block of rows rather than for each row.
+ * The call to the core's `load_chunk()` is devirtualized as `ActualWrapperChild` knows the exact type of the core, as in `devirtualize_class.cpp`.
+ */
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+
+class Spinlock {
+public:
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            while (locked.load(std::memory_order_relaxed)) {}
+        }
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> locked = false;
+};
+
+struct Chunk {
+    int id;
+    std::vector<double> values;
+};
+
+constexpr int MAX_READERS = 64;
+
+// Epoch-based reclamation, where each reader has its own slot for announcing the epoch in which it started.
+class EpochManager {
+public:
+    EpochManager() {
+        for (auto& r : readers) {
+            r.in_use.store(false, std::memory_order_relaxed);
+            r.epoch.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct alignas(64) Reader {
+        std::atomic<bool> in_use;
+        std::atomic<std::uint64_t> epoch; // zero if not currently reading.
+    };
+    Reader readers[MAX_READERS];
+    std::atomic<std::uint64_t> global = 1;
+
+public:
+    int register_reader() {
+        for (int r = 0; r < MAX_READERS; ++r) {
+            bool expected = false;
+            if (readers[r].in_use.compare_exchange_strong(expected, true)) {
+                return r;
+            }
+        }
+        throw std::runtime_error("no more than 'MAX_READERS' children can use the same cache");
+    }
+
+    void unregister_reader(int r) {
+        readers[r].in_use.store(false, std::memory_order_release);
+    }
+
+    void enter(int r) {
+        readers[r].epoch.store(global.load(std::memory_order_acquire), std::memory_order_relaxed);
+        // The announcement must be visible before the reader loads any slot pointers, which a seq_cst store alone does not guarantee.
+        // This pairs with the fence in 'safe()', which is executed after a chunk is unlinked from its slot.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void exit(int r) {
+        readers[r].epoch.store(0, std::memory_order_release);
+    }
+
+    // Calls 'exit()' on destruction, so that a reader is never left announced if an exception is thrown during its lookup.
+    class Guard {
+    public:
+        Guard(EpochManager& manager, int r) : manager(manager), r(r) {
+            manager.enter(r);
+        }
+
+        ~Guard() {
+            manager.exit(r);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+        EpochManager& manager;
+        int r;
+    };
+
+    // Returns the epoch at which a pointer was retired, after advancing the global epoch so that new readers cannot see it.
+    std::uint64_t retire() {
+        return global.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // A pointer retired in epoch 'e' is safe to free if all active readers entered after 'e'.
+    bool safe(std::uint64_t e) const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (const auto& r : readers) {
+            auto current = r.epoch.load(std::memory_order_seq_cst);
+            if (current && current <= e) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+constexpr int NSHARDS = 16;
+static_assert(NSHARDS > 0, "there should be at least one shard");
+
+class ChunkCache {
+public:
+    ChunkCache(int slots_per_shard) : shards(NSHARDS) {
+        if (slots_per_shard <= 0) {
+            throw std::invalid_argument("number of slots per shard should be positive");
+        }
+        for (auto& shard : shards) {
+            shard.slots = std::vector<Slot>(slots_per_shard);
+            for (auto& s : shard.slots) {
+                s.chunk.store(nullptr, std::memory_order_relaxed);
+                s.referenced.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ~ChunkCache() {
+        for (auto& shard : shards) {
+            for (auto& s : shard.slots) {
+                delete s.chunk.load(std::memory_order_relaxed);
+            }
+            for (auto& r : shard.retired) {
+                delete r.first;
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<const Chunk*> chunk;
+        std::atomic<std::uint8_t> referenced;
+    };
+
+    struct alignas(64) Shard {
+        std::vector<Slot> slots;
+        Spinlock lock; // only used for insertions.
+        int hand = 0;
+        std::vector<std::pair<const Chunk*, std::uint64_t> > retired;
+    };
+
+    std::vector<Shard> shards;
+
+public:
+    EpochManager epochs;
+
+    // Should only be called between 'epochs.enter()' and 'epochs.exit()'.
+    const Chunk* find(int id) {
+        auto& shard = shards[id % NSHARDS];
+        for (auto& s : shard.slots) {
+            auto current = s.chunk.load(std::memory_order_acquire);
+            if (current && current->id == id) {
+                // Only writing if the bit is not already set, to avoid bouncing the slot's cache line between threads on every hit.
+                if (!s.referenced.load(std::memory_order_relaxed)) {
+                    s.referenced.store(1, std::memory_order_relaxed);
+                }
+                return current;
+            }
+        }
+        return nullptr;
+    }
+
+    // Should only be called between 'epochs.enter()' and 'epochs.exit()'.
+    // Returns the chunk that is now in the cache, which may not be 'fresh' if another thread inserted the same chunk first.
+    const Chunk* insert(std::unique_ptr<Chunk> fresh) {
+        auto& shard = shards[fresh->id % NSHARDS];
+        std::lock_guard<Spinlock> lck(shard.lock);
+
+        for (auto& s : shard.slots) {
+            auto current = s.chunk.load(std::memory_order_relaxed);
+            if (current && current->id == fresh->id) {
+                return current;
+            }
+        }
+
+        // CLOCK: advancing the hand until we find a slot that has not been referenced since the last pass.
+        int nslots = shard.slots.size();
+        while (shard.slots[shard.hand].referenced.exchange(0, std::memory_order_relaxed)) {
+            shard.hand = (shard.hand + 1) % nslots;
+        }
+        auto& victim = shard.slots[shard.hand];
+        shard.hand = (shard.hand + 1) % nslots;
+
+        const Chunk* added = fresh.release();
+        auto old = victim.chunk.exchange(added, std::memory_order_acq_rel);
+        if (old) {
+            shard.retired.emplace_back(old, epochs.retire());
+        }
+
+        // Freeing any retired chunks that are no longer visible to any reader.
+        auto keep = std::partition(shard.retired.begin(), shard.retired.end(), [&](const std::pair<const Chunk*, std::uint64_t>& r) -> bool {
+            return !epochs.safe(r.second);
+        });
+        for (auto it = keep; it != shard.retired.end(); ++it) {
+            delete it->first;
+        }
+        shard.retired.erase(keep, shard.retired.end());
+        return added;
+    }
+};
+
+/*** Wrapper classes ***/
+
+class BaseCoreParent {
+public:
+    virtual ~BaseCoreParent() = default;
+    virtual int nrow() const = 0;
+    virtual int ncol() const = 0;
+    virtual int chunk_rows() const = 0;
+
+    // Decodes all rows of chunk 'id' into 'buffer', which should have space for 'chunk_rows() * ncol()' values.
+    virtual void load_chunk(int id, double* buffer) const = 0;
+};
+
+class BaseWrapperChild {
+public:
+    virtual ~BaseWrapperChild() = default;
+    virtual const double* wrapped_fetch(int r, double* buffer) = 0;
+};
+
+class BaseWrapperParent {
+public:
+    virtual ~BaseWrapperParent() = default;
+    virtual std::unique_ptr<BaseWrapperChild> initialize() const = 0;
+};
+
+template<class Core_>
+class ActualWrapperChild final : public BaseWrapperChild {
+public:
+    ActualWrapperChild(const Core_& core, ChunkCache& cache) : core(core), cache(cache), reader(cache.epochs.register_reader()) {}
+
+    ~ActualWrapperChild() {
+        cache.epochs.unregister_reader(reader);
+    }
+
+private:
+    const Core_& core;
+    ChunkCache& cache;
+    int reader;
+
+public:
+    const double* wrapped_fetch(int r, double* buffer) {
+        int NC = core.ncol();
+        int CR = core.chunk_rows();
+        int id = r / CR;
+
+        EpochManager::Guard guard(cache.epochs, reader);
+        auto chunk = cache.find(id);
+        if (!chunk) {
+            auto fresh = std::make_unique<Chunk>();
+            fresh->id = id;
+            fresh->values.resize(static_cast<std::size_t>(CR) * NC);
+            core.load_chunk(id, fresh->values.data());
+            chunk = cache.insert(std::move(fresh));
+        }
+
+        // Copying the row out of the chunk before 'guard' leaves the epoch, after which the chunk might be freed.
+        auto src = chunk->values.data() + static_cast<std::size_t>(r - id * CR) * NC;
+        std::copy_n(src, NC, buffer);
+        return buffer;
+    }
+};
+
+template<class Core_>
+class ActualWrapperParent final : public BaseWrapperParent {
+public:
+    ActualWrapperParent(std::shared_ptr<Core_> core, int slots_per_shard) : my_core_parent(std::move(core)), my_cache(std::make_unique<ChunkCache>(slots_per_shard)) {}
+
+    std::unique_ptr<BaseWrapperChild> initialize() const {
+        return std::make_unique<ActualWrapperChild<Core_> >(*my_core_parent, *my_cache);
+    }
+
+private:
+    std::shared_ptr<Core_> my_core_parent;
+    std::unique_ptr<ChunkCache> my_cache; // shared by all children.
+};
+
+/*** Concrete core class ***/
+
+class ScaledCoreParent final : public BaseCoreParent {
+public:
+    ScaledCoreParent(int nr, int nc, int cr, const std::int16_t* p, double s) : NR(nr), NC(nc), CR(cr), payload(p), scale(s) {}
+
+private:
+    int NR, NC, CR;
+    const std::int16_t* payload; // row-major, quantized values.
+    double scale;
+
+public:
+    int nrow() const { return NR; }
+    int ncol() const { return NC; }
+    int chunk_rows() const { return CR; }
+
+    void load_chunk(int id, double* buffer) const {
+        int start = id * CR, end = std::min(NR, start + CR);
+        auto src = payload + static_cast<std::size_t>(start) * NC;
+        for (std::size_t i = 0, n = static_cast<std::size_t>(end - start) * NC; i < n; ++i) {
+            buffer[i] = src[i] * scale;
+        }
+    }
+};
+
+double foo(const BaseWrapperParent& parent, int r, int NC) {
+    auto child = parent.initialize();
+    std::vector<double> buffer(NC);
+    auto ptr = child->wrapped_fetch(r, buffer.data());
+    return ptr[0];
+}
+
+double bar(std::shared_ptr<ScaledCoreParent> core, int r) {
+    int NC = core->ncol();
+    ActualWrapperParent<ScaledCoreParent> parent(std::move(core), 8);
+    return foo(parent, r, NC);
+}
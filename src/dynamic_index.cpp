@@ -0,0 +1,262 @@
+/* Test a dynamic approximate neighbor index that supports insertions and deletions without a full rebuild, as a possible addition to the [knncolle](https://github.com/knncolle/knncolle) library.
+ * The index is an inverted file: each observation is assigned to its closest centroid (from a previous k-means run, as in `kmknn.cpp`),
+ * and a query only scans the observations assigned to the `nprobe` centroids that are closest to the query.
+ * New observations are read through the same Matrix interface as in `devirtualize.cpp`, so inserting a point only costs a scan over the centroids plus an append to one cluster.
+ * Deleting a point just sets its tombstone, which is skipped during the search.
+ * The space for deleted points is eventually reclaimed by `compact()`, which rebuilds each cluster without its tombstones in a background thread.
+ *
+ * To avoid blocking searches during updates, each cluster is immutable once published and is referred to by a `std::shared_ptr`.
+ * Inserts and compaction create a new copy of each affected cluster and swap it in under a short-lived lock,
+ * while searches take a copy of the pointers for the probed clusters and scan them without holding any lock.
+ * Old copies are freed when the last search using them is finished.
+ * The cost of an insert is then proportional to the size of the affected clusters, which is similar to the cost of a query.
+ * Tombstones are stored in a preallocated array of atomic bytes so that they can be set while other threads are searching.
+ *
+ * The question is whether the tombstone check adds much to the scan in `search()`.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the relaxed atomic load of the tombstone is compiled to a plain `movzbl` and `test`/`jne` on the observation's ID,
+ * i.e., exactly the same as a load from a non-atomic array.
+ * This is a well-predicted branch when deletions are rare, which is the whole point of compacting regularly.
+ * Taking a snapshot involves atomic reference count increments (`lock addl`) for each probed cluster, but this only happens `nprobe` times per query.
+ * However, the pointer to the tombstone array and `ndim` are both reloaded from `this` for every observation,
+ * presumably because GCC cannot prove that they are unchanged across the atomic load and the out-of-line heap calls.
+ * It might be worth copying them to local variables before the loop, as we did for `kmeans_hamerly.cpp`.
+ */
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+struct Cluster {
+    std::vector<int> ids;
+    std::vector<double> coordinates; // coordinates of 'ids[i]' are at 'i * ndim'.
+};
+
+typedef std::pair<double, int> Neighbor;
+
+class DynamicIndex {
+public:
+    // 'capacity' is the maximum number of observations that can ever be inserted, as IDs are not reused.
+    DynamicIndex(int ndim, int ncenters, const double* centers, int capacity) :
+        ndim(ndim),
+        ncenters(ncenters),
+        capacity(capacity),
+        centers(centers, centers + static_cast<std::size_t>(ncenters) * ndim),
+        deleted(new std::atomic<std::uint8_t>[capacity]),
+        clusters(ncenters)
+    {
+        for (int i = 0; i < capacity; ++i) {
+            deleted[i].store(0, std::memory_order_relaxed);
+        }
+        for (auto& cl : clusters) {
+            cl = std::make_shared<const Cluster>();
+        }
+    }
+
+    ~DynamicIndex() {
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+    }
+
+private:
+    int ndim, ncenters, capacity;
+    std::vector<double> centers;
+    std::unique_ptr<std::atomic<std::uint8_t>[]> deleted;
+    std::atomic<int> ndeleted = 0;
+    int next_id = 0; // only accessed under 'write_lock'.
+    std::atomic<int> num_published = 0; // number of IDs whose observations are visible to searches.
+
+    std::mutex write_lock; // serializes all modifications, i.e., inserts and compaction.
+    mutable std::mutex snapshot_lock; // protects the pointers in 'clusters'.
+    std::vector<std::shared_ptr<const Cluster> > clusters;
+    std::thread compactor;
+
+    std::shared_ptr<const Cluster> fetch(int c) const {
+        std::lock_guard<std::mutex> lck(snapshot_lock);
+        return clusters[c];
+    }
+
+    void publish(int c, std::shared_ptr<const Cluster> replacement) {
+        std::lock_guard<std::mutex> lck(snapshot_lock);
+        clusters[c].swap(replacement);
+    } // old copy is released outside the lock, if no searches are using it.
+
+    std::vector<std::pair<double, int> > rank_centers(const double* query) const {
+        std::vector<std::pair<double, int> > order;
+        order.reserve(ncenters);
+        for (int c = 0; c < ncenters; ++c) {
+            order.emplace_back(squared_distance(query, centers.data() + static_cast<std::size_t>(c) * ndim, ndim), c);
+        }
+        return order;
+    }
+
+public:
+    // Inserts all observations in 'mat', returning the ID of the first one; the rest are numbered consecutively.
+    int insert(const BaseParent& mat) {
+        std::lock_guard<std::mutex> lck(write_lock);
+        int nobs = mat.num_observations();
+        if (nobs > capacity - next_id) {
+            throw std::length_error("total number of insertions should not exceed the capacity of the index");
+        }
+        int first = next_id;
+        auto ext = mat.create();
+
+        // Batching the new observations by cluster so that each affected cluster is only copied once.
+        std::vector<std::vector<double> > incoming_coords(ncenters);
+        std::vector<std::vector<int> > incoming_ids(ncenters);
+        for (int o = 0; o < nobs; ++o) {
+            auto ptr = ext->get();
+            int best = 0;
+            double best_dist = std::numeric_limits<double>::infinity();
+            for (int c = 0; c < ncenters; ++c) {
+                double dist = squared_distance(ptr, centers.data() + static_cast<std::size_t>(c) * ndim, ndim);
+                if (dist < best_dist) {
+                    best = c;
+                    best_dist = dist;
+                }
+            }
+            incoming_ids[best].push_back(next_id);
+            incoming_coords[best].insert(incoming_coords[best].end(), ptr, ptr + ndim);
+            ++next_id;
+        }
+
+        for (int c = 0; c < ncenters; ++c) {
+            if (incoming_ids[c].empty()) {
+                continue;
+            }
+            auto current = fetch(c);
+            auto replacement = std::make_shared<Cluster>(*current);
+            replacement->ids.insert(replacement->ids.end(), incoming_ids[c].begin(), incoming_ids[c].end());
+            replacement->coordinates.insert(replacement->coordinates.end(), incoming_coords[c].begin(), incoming_coords[c].end());
+            publish(c, std::move(replacement));
+        }
+
+        // Only allowing removal of the new IDs once all of their observations are visible.
+        num_published.store(next_id, std::memory_order_release);
+        return first;
+    }
+
+    void remove(int id) {
+        // Checking against the published IDs rather than 'capacity', otherwise a future insertion could be tombstoned before it happens.
+        if (id < 0 || id >= num_published.load(std::memory_order_acquire)) {
+            throw std::out_of_range("ID does not refer to an inserted observation");
+        }
+        if (deleted[id].exchange(1, std::memory_order_relaxed) == 0) {
+            ndeleted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Number of deleted observations that have not yet been removed by compaction.
+    int num_deleted() const {
+        return ndeleted.load(std::memory_order_relaxed);
+    }
+
+    // Starts a background compaction, waiting for any previous compaction to finish first.
+    void compact() {
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+
+        compactor = std::thread([&]() -> void {
+            for (int c = 0; c < ncenters; ++c) {
+                // Holding the write lock for each cluster so that no inserts are lost, but searches can proceed as usual.
+                std::lock_guard<std::mutex> lck(write_lock);
+                auto current = fetch(c);
+                auto replacement = std::make_shared<Cluster>();
+                int nremoved = 0;
+                for (std::size_t i = 0, n = current->ids.size(); i < n; ++i) {
+                    int id = current->ids[i];
+                    if (deleted[id].load(std::memory_order_relaxed)) {
+                        ++nremoved;
+                        continue;
+                    }
+                    replacement->ids.push_back(id);
+                    auto src = current->coordinates.data() + i * ndim;
+                    replacement->coordinates.insert(replacement->coordinates.end(), src, src + ndim);
+                }
+                if (nremoved) {
+                    publish(c, std::move(replacement));
+                    ndeleted.fetch_sub(nremoved, std::memory_order_relaxed); // the tombstones stay set, so these IDs are never counted again.
+                }
+            }
+        });
+    }
+
+    // Returns the 'k' closest non-deleted observations from the 'nprobe' clusters that are closest to 'query'.
+    void search(const double* query, int nprobe, int k, std::vector<Neighbor>& heap) const {
+        heap.clear();
+        if (k <= 0 || nprobe <= 0) {
+            return;
+        }
+
+        auto order = rank_centers(query);
+        nprobe = std::min(nprobe, ncenters);
+        std::partial_sort(order.begin(), order.begin() + nprobe, order.end());
+        std::vector<std::shared_ptr<const Cluster> > snapshot;
+        snapshot.reserve(nprobe);
+        {
+            std::lock_guard<std::mutex> lck(snapshot_lock);
+            for (int p = 0; p < nprobe; ++p) {
+                snapshot.push_back(clusters[order[p].second]);
+            }
+        }
+
+        for (const auto& cl : snapshot) {
+            auto cptr = cl->coordinates.data();
+            for (auto id : cl->ids) {
+                auto ptr = cptr;
+                cptr += ndim;
+                if (deleted[id].load(std::memory_order_relaxed)) {
+                    continue;
+                }
+
+                double dist = squared_distance(ptr, query, ndim);
+                if (static_cast<int>(heap.size()) < k) {
+                    heap.emplace_back(dist, id);
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (dist < heap.front().first) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = Neighbor(dist, id);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        }
+
+        std::sort_heap(heap.begin(), heap.end());
+    }
+};
+
+void foo(const DynamicIndex& index, const double* query, int nprobe, int k, std::vector<Neighbor>& heap) {
+    index.search(query, nprobe, k, heap);
+}
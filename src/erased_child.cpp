@@ -0,0 +1,229 @@
+/* Test a value-semantic alternative to the `BaseChild`/`BaseParent` classes in `devirtualize.cpp`, using type erasure with a manual "vtable".
+ * With virtual functions, each call to `get()` needs to load the vtable pointer from the object, then load the function pointer from the vtable, and then make the call.
+ * Here, `AnyChild` stores the function pointers directly inside itself, so the function pointer is loaded directly from the object, removing one dependent load.
+ * The child itself is constructed inside a small buffer in `AnyChild`, in the style of `std::function`, so no heap allocation is required for small children.
+ * Larger children (or those that might throw when moved) are allocated on the heap and the buffer holds a pointer instead, with a different set of function pointers.
+ * `AnyParent` holds the parent through a `std::shared_ptr` alongside a stored function pointer for `create()`, which returns an `AnyChild` by value.
+ * The concrete classes (`AChild`, `AParent`, etc.) no longer need to inherit from anything, they just need to provide the same methods.
+ *
+ * The question is whether the call to `get()` in the loop in `foo()` is actually cheaper than a virtual call.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the loop in `foo()` compiles to a single `call *32(%rsp)` on the function pointer stored in the local `AnyChild`,
+ * whereas `bar()` (using the classic interface) needs `movq (%rdi), %rax` to load the vtable pointer and then `call *16(%rax)` in each iteration.
+ * The creation of the child in `foo()` is an indirect call through the function pointer stored in `AnyParent`, which constructs the child directly in the returned `AnyChild`;
+ * the thunks for `AParent` and `BParent` do not contain any calls to `operator new`.
+ * By comparison, the classic `create()` returns a `std::unique_ptr` and so must allocate each child on the heap.
+ * On the other hand, the stored function pointers make each `AnyChild` larger than a single vtable pointer (24 bytes instead of 8, plus a flag),
+ * which does not matter for one child per thread but would be wasteful for large arrays of type-erased objects.
+ */
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+
+constexpr std::size_t BUFFER_SIZE = 32;
+
+class AnyChild {
+private:
+    struct Table {
+        int (*get)(void*);
+        void (*move)(void* dest, void* src) noexcept; // move-constructs into 'dest' and destroys 'src'.
+        void (*destroy)(void*) noexcept;
+    };
+
+    // Children with a throwing move constructor are always stored on the heap, as moving them in the noexcept 'move' thunk could otherwise call std::terminate().
+    template<class Child_>
+    static constexpr bool fits = sizeof(Child_) <= BUFFER_SIZE && alignof(Child_) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<Child_>::value;
+
+    template<class Child_>
+    static Child_* access(void* storage) {
+        if constexpr(fits<Child_>) {
+            return std::launder(static_cast<Child_*>(storage));
+        } else {
+            return *std::launder(static_cast<Child_**>(storage));
+        }
+    }
+
+    template<class Child_>
+    static Table make_table() {
+        Table output;
+        output.get = [](void* s) -> int { return access<Child_>(s)->get(); };
+        if constexpr(fits<Child_>) {
+            output.move = [](void* d, void* s) noexcept -> void {
+                auto ptr = access<Child_>(s);
+                new (d) Child_(std::move(*ptr));
+                ptr->~Child_();
+            };
+            output.destroy = [](void* s) noexcept -> void { access<Child_>(s)->~Child_(); };
+        } else {
+            output.move = [](void* d, void* s) noexcept -> void { new (d) Child_*(access<Child_>(s)); };
+            output.destroy = [](void* s) noexcept -> void { delete access<Child_>(s); };
+        }
+        return output;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[BUFFER_SIZE];
+    Table table{}; // only meaningful if 'active' is true.
+    bool active = false;
+
+public:
+    template<class Child_, typename... Args_>
+    static AnyChild make(Args_&&... args) {
+        AnyChild output;
+        if constexpr(fits<Child_>) {
+            new (output.storage) Child_(std::forward<Args_>(args)...);
+        } else {
+            new (output.storage) Child_*(new Child_(std::forward<Args_>(args)...));
+        }
+        output.table = make_table<Child_>();
+        output.active = true;
+        return output;
+    }
+
+    AnyChild() = default;
+
+    AnyChild(AnyChild&& other) noexcept : active(other.active) {
+        if (active) {
+            table = other.table;
+            table.move(storage, other.storage);
+            other.active = false;
+        }
+    }
+
+    AnyChild& operator=(AnyChild&& other) noexcept {
+        if (this != &other) {
+            if (active) {
+                table.destroy(storage);
+            }
+            active = other.active;
+            if (active) {
+                table = other.table;
+                table.move(storage, other.storage);
+                other.active = false;
+            }
+        }
+        return *this;
+    }
+
+    AnyChild(const AnyChild&) = delete;
+    AnyChild& operator=(const AnyChild&) = delete;
+
+    ~AnyChild() {
+        if (active) {
+            table.destroy(storage);
+        }
+    }
+
+    int get() {
+        return table.get(storage);
+    }
+};
+
+// For simplicity, parents are held by shared pointer, as they are usually large and long-lived.
+class AnyParent {
+private:
+    std::shared_ptr<const void> parent;
+    AnyChild (*create_fun)(const void*);
+
+public:
+    template<class Parent_>
+    AnyParent(std::shared_ptr<const Parent_> p) :
+        parent(std::move(p)),
+        create_fun([](const void* ptr) -> AnyChild { return static_cast<const Parent_*>(ptr)->create(); })
+    {}
+
+    AnyChild create() const {
+        return create_fun(parent.get());
+    }
+};
+
+/*** Concrete classes, no inheritance required ***/
+
+class AChild {
+public:
+    AChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload;
+    }
+};
+
+class AParent {
+public:
+    AParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    AnyChild create() const {
+        return AnyChild::make<AChild>(my_payload);
+    }
+};
+
+class BChild {
+public:
+    BChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload + 20;
+    }
+};
+
+class BParent {
+public:
+    BParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    AnyChild create() const {
+        return AnyChild::make<BChild>(my_payload);
+    }
+};
+
+int foo(const AnyParent& parent, int n) {
+    auto child = parent.create();
+    int output = 0;
+    for (int i = 0; i < n; ++i) {
+        output += child.get();
+    }
+    return output;
+}
+
+/*** Classic interface from devirtualize.cpp, for comparison ***/
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual int get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+int bar(const BaseParent& parent, int n) {
+    auto child = parent.create();
+    int output = 0;
+    for (int i = 0; i < n; ++i) {
+        output += child->get();
+    }
+    return output;
+}
+
+int baz(std::shared_ptr<const AParent> a, std::shared_ptr<const BParent> b, int n) {
+    return foo(AnyParent(std::move(a)), n) + foo(AnyParent(std::move(b)), n);
+}
@@ -0,0 +1,118 @@
+/* Test single-precision distance and centroid kernels for the Matrix interface used in `devirtualize.cpp`, templated on the type of the observations.
+ * Many embeddings are stored in single precision, so it would be nice to avoid converting them to double precision before neighbor search or clustering.
+ * In theory, `float` doubles the number of values per SIMD register and halves the memory traffic per observation.
+ * However, sums over many observations (e.g., for computing the centroids in k-means) should still be accumulated in double precision to avoid loss of precision.
+ *
+ * The question is whether the same distance kernel vectorizes equally well for both types.
+ * Our `d2_unrolled()` in `knn_brute_force.cpp` uses four independent accumulators,
+ * which fills a ymm register for `double` but only an xmm register for `float`.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2 -march=x86-64-v3`, the `float` version of that kernel indeed uses `vfmadd231ps` on xmm registers, i.e., only 4 lanes at a time.
+ * So, in `squared_distance()`, we set the number of accumulators to `32 / sizeof(Value_)`, i.e., the number of lanes in a 256-bit register.
+ * This gives us `vfmadd231ps` on ymm registers for `float` (8 lanes) and `vfmadd231pd` on ymm registers for `double` (4 lanes), from the same template.
+ * Without `-march`, we get `subps`/`mulps` and `subpd`/`mulpd` on xmm registers, respectively.
+ *
+ * In `add_to_sums()` (which is inlined into `iterate()`), the conversion of each `float` to `double` is not vectorized at `-O2`, giving a scalar `vcvtss2sd` per value.
+ * At `-O3`, this becomes `vcvtps2pd` that converts 4 values at a time.
+ * This is not a big deal as the centroid update is cheap compared to the distance calculations for the assignment.
+ */
+
+#include <vector>
+#include <memory>
+#include <limits>
+#include <cstddef>
+
+template<typename Value_>
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const Value_* get() = 0;
+};
+
+template<typename Value_>
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild<Value_> > create() const = 0;
+};
+
+template<typename Value_>
+Value_ squared_distance(const Value_* x, const Value_* y, int ndim) {
+    constexpr int nlanes = 32 / sizeof(Value_);
+    Value_ acc[nlanes] = {};
+    int d = 0;
+    for (; d + nlanes <= ndim; d += nlanes) {
+        for (int i = 0; i < nlanes; ++i) {
+            Value_ delta = x[d + i] - y[d + i];
+            acc[i] += delta * delta;
+        }
+    }
+    for (; d < ndim; ++d) {
+        Value_ delta = x[d] - y[d];
+        acc[0] += delta * delta;
+    }
+
+    Value_ output = 0;
+    for (int i = 0; i < nlanes; ++i) {
+        output += acc[i];
+    }
+    return output;
+}
+
+template<typename Value_>
+int closest(const Value_* obs, const Value_* centers, int ncenters, int ndim) {
+    int best = 0;
+    Value_ best_dist = std::numeric_limits<Value_>::infinity();
+    for (int c = 0; c < ncenters; ++c) {
+        Value_ dist = squared_distance(obs, centers + static_cast<std::size_t>(c) * ndim, ndim);
+        if (dist < best_dist) {
+            best = c;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+template<typename Value_>
+void add_to_sums(double* sums, const Value_* obs, int ndim) {
+    for (int d = 0; d < ndim; ++d) {
+        sums[d] += obs[d];
+    }
+}
+
+// One iteration of Lloyd's algorithm, where the centers are stored in the same precision as the observations but the sums are always in double precision.
+template<typename Value_>
+void iterate(const BaseParent<Value_>& mat, int ncenters, Value_* centers, int* clusters) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    std::vector<double> sums(static_cast<std::size_t>(ncenters) * ndim);
+    std::vector<int> counts(ncenters);
+    auto ext = mat.create();
+
+    for (int o = 0; o < nobs; ++o) {
+        auto ptr = ext->get();
+        int best = closest(ptr, centers, ncenters, ndim);
+        clusters[o] = best;
+        add_to_sums(sums.data() + static_cast<std::size_t>(best) * ndim, ptr, ndim);
+        ++counts[best];
+    }
+
+    for (int c = 0; c < ncenters; ++c) {
+        if (counts[c]) {
+            auto cptr = centers + static_cast<std::size_t>(c) * ndim;
+            auto sptr = sums.data() + static_cast<std::size_t>(c) * ndim;
+            for (int d = 0; d < ndim; ++d) {
+                cptr[d] = sptr[d] / counts[c];
+            }
+        }
+    }
+}
+
+void foo(const BaseParent<float>& mat, int ncenters, float* centers, int* clusters) {
+    iterate(mat, ncenters, centers, clusters);
+}
+
+void bar(const BaseParent<double>& mat, int ncenters, double* centers, int* clusters) {
+    iterate(mat, ncenters, centers, clusters);
+}
@@ -0,0 +1,231 @@
+/* Test the per-node locking in a graph-based approximate neighbor search index, in the style of HNSW as used by the [knncolle_hnsw](https://github.com/knncolle/knncolle_hnsw) library.
+ * Here, we only consider the bottom layer of the graph, where each node has up to `M` neighbors stored in a single flat adjacency array at `node * M`.
+ * The graph is built from a matrix through the Matrix interface (as in `devirtualize.cpp`), where each thread has its own extractor and inserts a contiguous range of nodes.
+ * Multiple threads insert nodes at the same time, so any update to a node's neighbor list must be protected by a lock on that node.
+ * A `std::mutex` per node is 40 bytes on x86-64 Linux, which is more than the adjacency list itself for small `M`, so we use a one-byte spinlock instead.
+ * Each insertion searches the graph while other threads are still linking nodes, so the searches cannot simply read the neighbor lists without synchronization.
+ * Rather than locking every node that is visited, the neighbor IDs and counts are atomics: a writer publishes a new neighbor with a release store to the count,
+ * or with a release store to the neighbor ID itself if it replaces an existing neighbor, while a reader loads both the count and the neighbor IDs with acquire.
+ * This ensures that a reader that sees a new neighbor also sees the coordinates that were copied into the graph before it was linked.
+ * A reader might see a list that is being modified, but every entry that it sees is a valid node, which is good enough for an approximate search.
+ *
+ * The question is whether the spinlock is as cheap as we expect.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `Spinlock::lock()` compiles to an `xchgb` (which is implicitly locked) in a loop,
+ * with the inner wait loop doing a plain `movzbl` load so that waiting threads don't keep taking the cache line in exclusive mode.
+ * `Spinlock::unlock()` is a plain `movb $0`, as release stores need no fence on x86.
+ * Both are inlined into `link()`, so the uncontended cost of updating a neighbor list is one atomic exchange.
+ * The acquire loads of the neighbors and counts in `search_layer()` are also plain `mov`s, so searches are no more expensive than with non-atomic arrays.
+ *
+ * In `search_layer()`, the beam search keeps up to `ef` candidates in a pair of `std::priority_queue`s.
+ * Each push or pop calls the out-of-line `std::__push_heap` or `std::__adjust_heap` helpers, but only for neighbors that are close enough to enter the candidate list.
+ * For large `ef`, it might be worth reusing the queues' storage across queries to avoid the `_M_realloc_insert` calls as they grow.
+ * The visited set is a vector of marks that is reused across queries by incrementing the mark instead of clearing the vector.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+class Spinlock {
+public:
+    void lock() {
+        while (flag.exchange(true, std::memory_order_acquire)) {
+            while (flag.load(std::memory_order_relaxed)) {}
+        }
+    }
+
+    void unlock() {
+        flag.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> flag{false};
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+class Graph {
+public:
+    Graph(const BaseParent& mat, int M, int ef_construction, int nthreads) :
+        ndim(mat.num_dimensions()),
+        M(M),
+        data(static_cast<std::size_t>(mat.num_observations()) * ndim),
+        neighbors(static_cast<std::size_t>(mat.num_observations()) * M),
+        counts(mat.num_observations()),
+        locks(mat.num_observations())
+    {
+        int nobs = mat.num_observations();
+        if (nobs == 0) {
+            return;
+        }
+
+        // Node 0 is the entry point for all searches, so it is copied before any other node is inserted.
+        // The other nodes are split into contiguous ranges, one per thread.
+        {
+            auto ext = mat.create();
+            std::copy_n(ext->get(0), ndim, coordinates(0));
+        }
+
+        int nremaining = nobs - 1;
+        int per_thread = nremaining / nthreads + (nremaining % nthreads > 0);
+        std::vector<std::thread> workers;
+        workers.reserve(nthreads);
+
+        for (int t = 0; t < nthreads; ++t) {
+            int start = 1 + std::min(nremaining, t * per_thread);
+            int length = std::min(nobs - start, per_thread);
+            workers.emplace_back([&](int start, int length) -> void {
+                auto ext = mat.create();
+                std::vector<std::uint32_t> visited(nobs);
+                std::uint32_t mark = 0;
+                for (int o = start, end = start + length; o < end; ++o) {
+                    // Other threads only see this node's coordinates after it is published by the release store in 'link()'.
+                    std::copy_n(ext->get(o), ndim, coordinates(o));
+                    insert(o, ef_construction, visited, ++mark);
+                }
+            }, start, length);
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+private:
+    int ndim;
+    int M;
+    std::vector<double> data;
+    std::vector<std::atomic<int> > neighbors;
+    std::vector<std::atomic<int> > counts;
+    std::vector<Spinlock> locks;
+
+    double* coordinates(int node) {
+        return data.data() + static_cast<std::size_t>(node) * ndim;
+    }
+
+    const double* coordinates(int node) const {
+        return data.data() + static_cast<std::size_t>(node) * ndim;
+    }
+
+public:
+    // Adds 'to' as a neighbor of 'from', replacing the furthest existing neighbor if the list is already full.
+    void link(int from, int to) {
+        auto fptr = coordinates(from);
+        double dist = squared_distance(fptr, coordinates(to), ndim);
+        auto nptr = neighbors.data() + static_cast<std::size_t>(from) * M;
+
+        locks[from].lock();
+        int count = counts[from].load(std::memory_order_relaxed);
+        if (count < M) {
+            nptr[count].store(to, std::memory_order_relaxed);
+            counts[from].store(count + 1, std::memory_order_release); // publishing the new neighbor to concurrent searches.
+        } else {
+            int worst = 0;
+            double worst_dist = -1;
+            for (int i = 0; i < M; ++i) {
+                double current = squared_distance(fptr, coordinates(nptr[i].load(std::memory_order_relaxed)), ndim);
+                if (current > worst_dist) {
+                    worst = i;
+                    worst_dist = current;
+                }
+            }
+            if (dist < worst_dist) {
+                nptr[worst].store(to, std::memory_order_release); // also publishing, as the count does not change.
+            }
+        }
+        locks[from].unlock();
+    }
+
+    typedef std::pair<double, int> Candidate;
+
+    // Greedy beam search from 'entry', keeping the 'ef' closest nodes seen so far in 'found' (a max-heap on distance).
+    // This can be called while other threads are calling 'link()'.
+    void search_layer(const double* query, int entry, int ef, std::vector<std::uint32_t>& visited, std::uint32_t mark, std::priority_queue<Candidate>& found) const {
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > frontier;
+        double entry_dist = squared_distance(query, coordinates(entry), ndim);
+        frontier.emplace(entry_dist, entry);
+        found.emplace(entry_dist, entry);
+        visited[entry] = mark;
+
+        while (!frontier.empty()) {
+            auto current = frontier.top();
+            if (current.first > found.top().first) {
+                break;
+            }
+            frontier.pop();
+
+            auto nptr = neighbors.data() + static_cast<std::size_t>(current.second) * M;
+            int ncount = counts[current.second].load(std::memory_order_acquire);
+            for (int i = 0; i < ncount; ++i) {
+                int next = nptr[i].load(std::memory_order_acquire);
+                if (visited[next] == mark) {
+                    continue;
+                }
+                visited[next] = mark;
+
+                double dist = squared_distance(query, coordinates(next), ndim);
+                if (static_cast<int>(found.size()) < ef || dist < found.top().first) {
+                    frontier.emplace(dist, next);
+                    found.emplace(dist, next);
+                    if (static_cast<int>(found.size()) > ef) {
+                        found.pop();
+                    }
+                }
+            }
+        }
+    }
+
+    // Links 'node' to its 'M' closest nodes among those found by a search with 'ef' candidates, in both directions.
+    void insert(int node, int ef, std::vector<std::uint32_t>& visited, std::uint32_t mark) {
+        std::priority_queue<Candidate> found;
+        search_layer(coordinates(node), 0, ef, visited, mark, found);
+        while (static_cast<int>(found.size()) > M) {
+            found.pop();
+        }
+        while (!found.empty()) {
+            int other = found.top().second;
+            found.pop();
+            link(node, other);
+            link(other, node);
+        }
+    }
+};
+
+void foo(Graph& graph, int from, int to) {
+    graph.link(from, to);
+}
+
+int bar(const Graph& graph, const double* query, int ef, std::vector<std::uint32_t>& visited, std::uint32_t mark) {
+    std::priority_queue<Graph::Candidate> found;
+    graph.search_layer(query, 0, ef, visited, mark, found);
+    while (found.size() > 1) {
+        found.pop();
+    }
+    return found.top().second;
+}
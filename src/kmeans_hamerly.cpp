@@ -0,0 +1,123 @@
+/* Test the bound checks in Hamerly's accelerated k-means algorithm, as a possible addition to the [CppKmeans](https://github.com/LTLA/CppKmeans) library.
+ * Each observation has an upper bound on the distance to its assigned centroid and a lower bound on the distance to the second-closest centroid.
+ * After the centroids move, the upper bound is increased by the drift of the assigned centroid and the lower bound is decreased by the largest drift of any centroid.
+ * If the upper bound is still below the lower bound (or half the distance from the assigned centroid to its closest other centroid), the assignment cannot change.
+ * In that case, we skip the extraction of the observation and all of its distance calculations.
+ * The assignments are the same as those from Lloyd's algorithm (see `kmeans_lloyd.cpp`) as long as there are no ties.
+ * If an observation is equidistant from its assigned centroid and another centroid, this code keeps the current assignment while `kmeans_lloyd.cpp` chooses the centroid with the lowest index.
+ * The two also compute distances differently (Euclidean distances here, squared distances in `kmeans_lloyd.cpp`), so near-ties might be broken differently due to round-off error.
+ *
+ * As most observations stop changing clusters after a few iterations, the loop in `assign()` mostly runs through the skip path.
+ * The question is how cheap this skip path is, given that it is sitting next to a virtual call to the extractor.
+ * For this to work, the extractor needs to support random access via `get(i)`, otherwise we would have to extract every observation anyway.
+ *
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the skip path in `assign()` consists of a load of the assignment, an `addsd` for the upper bound,
+ * a `subsd` for the lower bound, a `maxsd` to combine the lower bound with the centroid separation, and a `comisd` and branch.
+ * There are no calls on this path, but the pointers to `clusters`, `drift` and `separation` are reloaded from the stack in each iteration,
+ * as the register pressure from the slow path (with its virtual call and loops over centroids) forces them to be spilled.
+ * We also have to copy `bounds.upper.data()` and `bounds.lower.data()` into local variables before the loop;
+ * otherwise, GCC reloads the data pointers from the `Bounds` object in every iteration, presumably because it can't prove that the virtual call doesn't modify them.
+ * The bounds are stored as separate arrays rather than an array of structs, so the skip path streams through contiguous arrays.
+ * If the bound check fails, we first tighten the upper bound with the exact distance to the assigned centroid before resorting to a full search over all centroids.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double euclidean(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return std::sqrt(output);
+}
+
+struct Bounds {
+    std::vector<double> upper;
+    std::vector<double> lower;
+};
+
+// 'drift' holds the distance that each centroid moved in the last update, while 'separation' holds half the distance to the closest other centroid.
+// Returns the number of observations that changed clusters.
+int assign(
+    const BaseParent& mat,
+    int ncenters,
+    const double* centers,
+    const double* drift,
+    const double* separation,
+    int* clusters,
+    Bounds& bounds)
+{
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    double max_drift = *std::max_element(drift, drift + ncenters);
+    auto ext = mat.create();
+    int changed = 0;
+    auto uptr = bounds.upper.data();
+    auto lptr = bounds.lower.data();
+
+    for (int o = 0; o < nobs; ++o) {
+        int current = clusters[o];
+        double upper = uptr[o] + drift[current];
+        double lower = lptr[o] - max_drift;
+        uptr[o] = upper;
+        lptr[o] = lower;
+
+        double threshold = std::max(lower, separation[current]);
+        if (upper <= threshold) {
+            continue;
+        }
+
+        auto ptr = ext->get(o);
+        upper = euclidean(ptr, centers + static_cast<std::size_t>(current) * ndim, ndim);
+        uptr[o] = upper;
+        if (upper <= threshold) {
+            continue;
+        }
+
+        int best = current;
+        double best_dist = upper;
+        double second_dist = std::numeric_limits<double>::infinity();
+        for (int c = 0; c < ncenters; ++c) {
+            if (c == current) {
+                continue;
+            }
+            double dist = euclidean(ptr, centers + static_cast<std::size_t>(c) * ndim, ndim);
+            if (dist < best_dist) {
+                second_dist = best_dist;
+                best_dist = dist;
+                best = c;
+            } else if (dist < second_dist) {
+                second_dist = dist;
+            }
+        }
+
+        uptr[o] = best_dist;
+        lptr[o] = second_dist;
+        if (best != current) {
+            clusters[o] = best;
+            ++changed;
+        }
+    }
+
+    return changed;
+}
@@ -0,0 +1,190 @@
+/* Test a block-parallel version of the optimal-transfer stage of the Hartigan-Wong algorithm, based on the `kmeans::RefineHartiganWong` class in the [CppKmeans](https://github.com/LTLA/CppKmeans) library.
+ * In the original algorithm, each observation is considered in turn for transfer to another cluster, and the centroids are updated immediately after each transfer.
+ * This is inherently sequential as each decision depends on all previous transfers.
+ *
+ * Here, observations are processed in fixed-size blocks.
+ * For each block, candidate transfers are evaluated in parallel against a snapshot of the centroids and cluster sizes at the start of the block.
+ * The candidates are then committed serially in order of observation index, where each candidate is re-checked against the current centroids before it is applied.
+ * As the block size does not depend on the number of threads, and each candidate only depends on the snapshot, the results are identical for any number of threads.
+ * (They are not identical to the original sequential algorithm, though the final clustering is still a local optimum in the Hartigan-Wong sense.)
+ *
+ * As in the original Fortran code, the cost of a transfer uses `n / (n + 1)` and `n / (n - 1)` factors for each cluster of size `n`,
+ * which are precomputed in the `an2` and `an1` arrays so that there are no divisions when evaluating candidates.
+ * The question is whether the candidate loop in `evaluate()` is free of divisions and as tight as we expect.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the loop over clusters in `evaluate()` has no `divsd`,
+ * and the distance calculation is inlined with a single `mulsd` to scale it by `an2[c]` before the comparison.
+ * The comparison itself is branchless, using `minsd` to update `best_cost` and `cmova` to update `best`.
+ * The threads only read from the shared snapshot and write to their own contiguous range of `candidates`, so the only synchronization is a barrier before and after the commit.
+ * The threads are created once per pass rather than once per block, and the calling thread participates as thread 0, which also performs the serial commit.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+struct State {
+    int ndim;
+    int ncenters;
+    std::vector<double> centers;
+    std::vector<int> sizes;
+    std::vector<double> an1; // n / (n - 1), or infinity if n <= 1.
+    std::vector<double> an2; // n / (n + 1).
+
+    void update_factors(int c) {
+        double n = sizes[c];
+        an2[c] = n / (n + 1);
+        an1[c] = (sizes[c] > 1 ? n / (n - 1) : std::numeric_limits<double>::infinity());
+    }
+};
+
+// Returns the best cluster to transfer 'obs' to, or 'current' if no transfer would reduce the within-cluster sum of squares.
+int evaluate(const State& state, const double* obs, int current) {
+    int ndim = state.ndim;
+    double removal = state.an1[current] * squared_distance(obs, state.centers.data() + static_cast<std::size_t>(current) * ndim, ndim);
+
+    int best = current;
+    double best_cost = removal;
+    for (int c = 0; c < state.ncenters; ++c) {
+        if (c == current) {
+            continue;
+        }
+        double cost = state.an2[c] * squared_distance(obs, state.centers.data() + static_cast<std::size_t>(c) * ndim, ndim);
+        if (cost < best_cost) {
+            best = c;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+void transfer(State& state, const double* obs, int from, int to) {
+    int ndim = state.ndim;
+    auto fptr = state.centers.data() + static_cast<std::size_t>(from) * ndim;
+    auto tptr = state.centers.data() + static_cast<std::size_t>(to) * ndim;
+    double nfrom = state.sizes[from], nto = state.sizes[to];
+    for (int d = 0; d < ndim; ++d) {
+        fptr[d] = (fptr[d] * nfrom - obs[d]) / (nfrom - 1);
+        tptr[d] = (tptr[d] * nto + obs[d]) / (nto + 1);
+    }
+    --state.sizes[from];
+    ++state.sizes[to];
+    state.update_factors(from);
+    state.update_factors(to);
+}
+
+constexpr int BLOCK_SIZE = 1024;
+
+// Reusable barrier for a fixed number of threads, as std::barrier is not available in C++17.
+class Barrier {
+public:
+    Barrier(int n) : count(n) {}
+
+    void arrive_and_wait() {
+        std::unique_lock<std::mutex> lck(lock);
+        auto gen = generation;
+        if (++waiting == count) {
+            waiting = 0;
+            ++generation;
+            cv.notify_all();
+        } else {
+            cv.wait(lck, [&]() -> bool { return gen != generation; });
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    int count;
+    int waiting = 0;
+    std::uint64_t generation = 0;
+};
+
+// Returns the number of transfers in this pass.
+int optimal_transfer(const BaseParent& mat, State& state, int* clusters, int nthreads) {
+    int ndim = state.ndim;
+    int nobs = mat.num_observations();
+    std::vector<int> candidates(BLOCK_SIZE);
+    int ntransfers = 0;
+
+    // Each thread evaluates a contiguous range of each block, so that threads do not write to the same cache lines of 'candidates'.
+    // Thread 0 (the calling thread) also commits the candidates between the two barriers, while the other threads wait.
+    int per_thread = BLOCK_SIZE / nthreads + (BLOCK_SIZE % nthreads > 0);
+    Barrier barrier(nthreads);
+
+    auto run = [&](int t) -> void {
+        auto ext = mat.create();
+        for (int start = 0; start < nobs; start += BLOCK_SIZE) {
+            int length = std::min(BLOCK_SIZE, nobs - start);
+            for (int i = std::min(length, t * per_thread), end = std::min(length, i + per_thread); i < end; ++i) {
+                int o = start + i;
+                candidates[i] = evaluate(state, ext->get(o), clusters[o]);
+            }
+            barrier.arrive_and_wait();
+
+            if (t == 0) {
+                for (int i = 0; i < length; ++i) {
+                    int o = start + i;
+                    int current = clusters[o];
+                    if (candidates[i] == current || state.sizes[current] <= 1) {
+                        continue;
+                    }
+
+                    // Re-checking against the current state, as earlier transfers in this block may have changed the centroids.
+                    auto ptr = ext->get(o);
+                    int to = candidates[i];
+                    double removal = state.an1[current] * squared_distance(ptr, state.centers.data() + static_cast<std::size_t>(current) * ndim, ndim);
+                    double addition = state.an2[to] * squared_distance(ptr, state.centers.data() + static_cast<std::size_t>(to) * ndim, ndim);
+                    if (addition < removal) {
+                        transfer(state, ptr, current, to);
+                        clusters[o] = to;
+                        ++ntransfers;
+                    }
+                }
+            }
+            barrier.arrive_and_wait();
+        }
+    };
+
+    // The threads are only created once for all blocks.
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads - 1);
+    for (int t = 1; t < nthreads; ++t) {
+        workers.emplace_back(run, t);
+    }
+    run(0);
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    return ntransfers;
+}
@@ -0,0 +1,283 @@
+/* Test the inner loops of a parallel k-means++ initialization, as a possible addition to the [CppKmeans](https://github.com/LTLA/CppKmeans) library.
+ * In k-means++, each new center is sampled with probability proportional to the squared distance of each observation to its closest existing center.
+ * After each new center is chosen, every observation's minimum distance must be updated, which requires a pass over the entire dataset.
+ * Here, each thread owns a contiguous range of the minimum distance array and extracts its observations through its own instance of the Matrix interface (as in `devirtualize.cpp`).
+ * Each thread also reports the sum of its minimum distances, so the sampling only needs a prefix sum over the per-thread totals
+ * to choose the thread, followed by a cumulative scan within that thread's range to choose the observation.
+ * The same scheme is used in `oversample()` for the k-means|| initialization, where each thread independently samples observations in its range
+ * with its own random number generator; the results are concatenated in thread order so that they do not depend on thread scheduling.
+ * In `kmeans_parallel()`, each round of oversampling is followed by a parallel pass that updates the minimum distances to the newly sampled candidates,
+ * so each round only needs to compute distances to the candidates from the previous round.
+ * After the last round, each candidate is weighted by the number of observations for which it is the closest candidate (counted per thread and summed in thread order),
+ * and the candidates are reduced to the final centers by a weighted k-means++ on the candidates alone, which is cheap as there are only `O(oversampling * nrounds)` of them.
+ *
+ * The question is whether `update_distances()` is vectorized, as this is run once per center for every observation.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, we get a scalar loop with `minsd` and `addsd`.
+ * At `-O3`, the `std::min()` is vectorized with `minpd` (after a runtime check that `newdist` and `mindist` do not overlap), but the sum is still accumulated one element at a time with `addsd`,
+ * as the compiler is not allowed to reorder floating-point additions.
+ * This is good enough as the loop is dominated by the distance calculation to the new center anyway.
+ * It does mean that the per-thread totals are exactly reproducible for a given number of threads, which is necessary for a reproducible sampling.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create(int start, int length) const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+// Updates 'mindist' with the distances to the newest center in 'newdist', and returns the sum of the updated minimum distances.
+double update_distances(int length, const double* newdist, double* mindist) {
+    double total = 0;
+    for (int i = 0; i < length; ++i) {
+        mindist[i] = std::min(mindist[i], newdist[i]);
+        total += mindist[i];
+    }
+    return total;
+}
+
+template<class Function_>
+void parallelize(int nobs, int nthreads, Function_ fun) {
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    int per_thread = nobs / nthreads + (nobs % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        int start = std::min(nobs, t * per_thread);
+        int length = std::min(nobs - start, per_thread);
+        workers.emplace_back(fun, t, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Chooses 'ncenters' observations by k-means++, storing their indices in 'chosen'.
+void kmeanspp(const BaseParent& mat, int ncenters, int nthreads, std::uint64_t seed, std::vector<int>& chosen) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    chosen.clear();
+    if (nobs == 0) {
+        return;
+    }
+
+    std::mt19937_64 rng(seed);
+    std::vector<double> mindist(nobs, std::numeric_limits<double>::infinity());
+    std::vector<double> thread_totals(nthreads);
+    std::vector<double> center(ndim);
+    chosen.push_back(std::uniform_int_distribution<int>(0, nobs - 1)(rng));
+
+    while (static_cast<int>(chosen.size()) < ncenters) {
+        {
+            auto ext = mat.create(chosen.back(), 1);
+            std::copy_n(ext->get(), ndim, center.data());
+        }
+
+        parallelize(nobs, nthreads, [&](int t, int start, int length) -> void {
+            auto ext = mat.create(start, length);
+            std::vector<double> newdist(length);
+            for (int i = 0; i < length; ++i) {
+                newdist[i] = squared_distance(ext->get(), center.data(), ndim);
+            }
+            thread_totals[t] = update_distances(length, newdist.data(), mindist.data() + start);
+        });
+
+        std::vector<double> cumulative(nthreads);
+        std::partial_sum(thread_totals.begin(), thread_totals.end(), cumulative.begin());
+        if (cumulative.back() == 0) {
+            break; // all remaining observations are duplicates of existing centers.
+        }
+
+        double target = std::uniform_real_distribution<double>(0, cumulative.back())(rng);
+        int thread = std::upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin();
+        thread = std::min(thread, nthreads - 1);
+
+        int per_thread = nobs / nthreads + (nobs % nthreads > 0);
+        int start = std::min(nobs, thread * per_thread), end = std::min(nobs, start + per_thread);
+        double remaining = target - (thread ? cumulative[thread - 1] : 0);
+        int pos = start;
+        for (; pos < end - 1; ++pos) {
+            remaining -= mindist[pos];
+            if (remaining < 0) {
+                break;
+            }
+        }
+        chosen.push_back(pos);
+    }
+}
+
+// One round of k-means|| oversampling, where each observation is selected with probability 'oversampling * mindist / total'.
+void oversample(int nobs, int nthreads, const double* mindist, double total, double oversampling, std::uint64_t seed, std::vector<int>& selected) {
+    std::vector<std::vector<int> > thread_selected(nthreads);
+    parallelize(nobs, nthreads, [&](int t, int start, int length) -> void {
+        std::mt19937_64 rng(seed + t);
+        std::uniform_real_distribution<double> dist(0, 1);
+        auto& current = thread_selected[t];
+        for (int i = start, end = start + length; i < end; ++i) {
+            if (dist(rng) * total < oversampling * mindist[i]) {
+                current.push_back(i);
+            }
+        }
+    });
+
+    for (const auto& current : thread_selected) {
+        selected.insert(selected.end(), current.begin(), current.end());
+    }
+}
+
+// Updates 'mindist' with the distances to the 'nnew' centers in 'new_centers', returning the sum of the updated minimum distances.
+double update_min_distances(const BaseParent& mat, const double* new_centers, int nnew, int nthreads, double* mindist) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    std::vector<double> thread_totals(nthreads);
+    parallelize(nobs, nthreads, [&](int t, int start, int length) -> void {
+        auto ext = mat.create(start, length);
+        std::vector<double> newdist(length);
+        for (int i = 0; i < length; ++i) {
+            auto ptr = ext->get();
+            double best = std::numeric_limits<double>::infinity();
+            for (int c = 0; c < nnew; ++c) {
+                best = std::min(best, squared_distance(ptr, new_centers + static_cast<std::size_t>(c) * ndim, ndim));
+            }
+            newdist[i] = best;
+        }
+        thread_totals[t] = update_distances(length, newdist.data(), mindist + start);
+    });
+    return std::accumulate(thread_totals.begin(), thread_totals.end(), 0.0);
+}
+
+void extract_centers(const BaseParent& mat, const int* indices, int n, double* output) {
+    int ndim = mat.num_dimensions();
+    for (int i = 0; i < n; ++i) {
+        auto ext = mat.create(indices[i], 1);
+        std::copy_n(ext->get(), ndim, output + static_cast<std::size_t>(i) * ndim);
+    }
+}
+
+// Chooses 'ncenters' observations by k-means|| with 'nrounds' rounds of oversampling, storing their indices in 'chosen'.
+void kmeans_parallel(const BaseParent& mat, int ncenters, int nrounds, double oversampling, int nthreads, std::uint64_t seed, std::vector<int>& chosen) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    chosen.clear();
+    if (nobs == 0 || ncenters <= 0) {
+        return;
+    }
+
+    std::mt19937_64 rng(seed);
+    std::vector<int> candidates { std::uniform_int_distribution<int>(0, nobs - 1)(rng) };
+    std::vector<double> candidate_centers(ndim);
+    extract_centers(mat, candidates.data(), 1, candidate_centers.data());
+    std::vector<double> mindist(nobs, std::numeric_limits<double>::infinity());
+    double total = update_min_distances(mat, candidate_centers.data(), 1, nthreads, mindist.data());
+
+    for (int r = 0; r < nrounds && total > 0; ++r) {
+        std::vector<int> selected;
+        oversample(nobs, nthreads, mindist.data(), total, oversampling, rng(), selected);
+        if (selected.empty()) {
+            continue;
+        }
+
+        // Only computing distances to the candidates from this round, as 'mindist' already accounts for the earlier candidates.
+        int nselected = selected.size();
+        std::vector<double> selected_centers(static_cast<std::size_t>(nselected) * ndim);
+        extract_centers(mat, selected.data(), nselected, selected_centers.data());
+        total = update_min_distances(mat, selected_centers.data(), nselected, nthreads, mindist.data());
+
+        candidates.insert(candidates.end(), selected.begin(), selected.end());
+        candidate_centers.insert(candidate_centers.end(), selected_centers.begin(), selected_centers.end());
+    }
+
+    int ncandidates = candidates.size();
+    if (ncandidates <= ncenters) {
+        chosen.swap(candidates);
+        return;
+    }
+
+    // Weighting each candidate by the number of observations that are closest to it.
+    std::vector<std::vector<int> > thread_weights(nthreads);
+    parallelize(nobs, nthreads, [&](int t, int start, int length) -> void {
+        auto ext = mat.create(start, length);
+        auto& weights = thread_weights[t];
+        weights.resize(ncandidates);
+        for (int i = 0; i < length; ++i) {
+            auto ptr = ext->get();
+            int best = 0;
+            double best_dist = std::numeric_limits<double>::infinity();
+            for (int c = 0; c < ncandidates; ++c) {
+                double dist = squared_distance(ptr, candidate_centers.data() + static_cast<std::size_t>(c) * ndim, ndim);
+                if (dist < best_dist) {
+                    best = c;
+                    best_dist = dist;
+                }
+            }
+            ++weights[best];
+        }
+    });
+
+    std::vector<double> weights(ncandidates);
+    for (const auto& current : thread_weights) {
+        for (int c = 0; c < ncandidates; ++c) {
+            weights[c] += current[c];
+        }
+    }
+
+    // Reducing the candidates to 'ncenters' by weighted k-means++, where each candidate's sampling probability is also scaled by its weight.
+    std::vector<double> candidate_mindist(ncandidates, std::numeric_limits<double>::infinity());
+    std::vector<int> reduced;
+    {
+        std::discrete_distribution<int> first(weights.begin(), weights.end());
+        reduced.push_back(first(rng));
+    }
+
+    while (static_cast<int>(reduced.size()) < ncenters) {
+        auto latest = candidate_centers.data() + static_cast<std::size_t>(reduced.back()) * ndim;
+        double candidate_total = 0;
+        for (int c = 0; c < ncandidates; ++c) {
+            double dist = squared_distance(candidate_centers.data() + static_cast<std::size_t>(c) * ndim, latest, ndim);
+            candidate_mindist[c] = std::min(candidate_mindist[c], dist);
+            candidate_total += weights[c] * candidate_mindist[c];
+        }
+        if (candidate_total == 0) {
+            break; // all remaining candidates are duplicates of existing centers, or have zero weight.
+        }
+
+        double remaining = std::uniform_real_distribution<double>(0, candidate_total)(rng);
+        int pos = 0;
+        for (; pos < ncandidates - 1; ++pos) {
+            remaining -= weights[pos] * candidate_mindist[pos];
+            if (remaining < 0) {
+                break;
+            }
+        }
+        reduced.push_back(pos);
+    }
+
+    for (auto c : reduced) {
+        chosen.push_back(candidates[c]);
+    }
+}
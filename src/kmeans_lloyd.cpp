@@ -0,0 +1,146 @@
+/* Test the per-thread accumulators in a parallel implementation of Lloyd's algorithm for k-means clustering, based on the `kmeans::RefineLloyd` class in the [CppKmeans](https://github.com/LTLA/CppKmeans) library.
+ * Each thread processes a contiguous range of observations, which are extracted through its own instance of the Matrix interface (as in `devirtualize.cpp`).
+ * Each observation is assigned to its closest centroid, and its coordinates are added to the thread's private sums for that centroid.
+ * At the end of each iteration, the private sums are merged across threads with a pairwise tree reduction before computing the new centroids.
+ * The tree reduction ensures that the order of additions only depends on the number of threads, not on their scheduling.
+ *
+ * The question is whether the per-thread buffers are actually separated in memory to avoid false sharing of cache lines.
+ * Each thread's state is stored in an `alignas(64)` struct, and we put these structs in a `std::vector`.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the vector's allocation calls `operator new(unsigned long, std::align_val_t)` with an alignment of 64,
+ * which is the C++17 over-aligned allocation, so each `ThreadState` starts on its own cache line.
+ * With `--std=c++14`, GCC silently falls back to the plain `operator new`, which only guarantees 16-byte alignment, so false sharing would be possible.
+ * The centroid sums are stored in separate `std::vector`s per thread, so they are separate heap allocations and any false sharing is limited to their ends.
+ *
+ * In the assignment step, `closest()` uses the same four-accumulator distance calculation as `d2_unrolled()` in `knn_brute_force.cpp`,
+ * which is vectorized with `vfmadd231pd` on ymm registers when compiled with `-march=x86-64-v3`.
+ * The extractor's `get()` is called through a virtual dispatch as the matrix type is not known here, but this is amortized across the distance calculations for all centroids.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create(int start, int length) const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    int d = 0;
+    for (; d + 4 <= ndim; d += 4) {
+        double delta0 = x[d] - y[d];
+        double delta1 = x[d + 1] - y[d + 1];
+        double delta2 = x[d + 2] - y[d + 2];
+        double delta3 = x[d + 3] - y[d + 3];
+        acc0 += delta0 * delta0;
+        acc1 += delta1 * delta1;
+        acc2 += delta2 * delta2;
+        acc3 += delta3 * delta3;
+    }
+    for (; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        acc0 += delta * delta;
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+int closest(const double* obs, const double* centers, int ncenters, int ndim) {
+    int best = 0;
+    double best_dist = std::numeric_limits<double>::infinity();
+    for (int c = 0; c < ncenters; ++c) {
+        double dist = squared_distance(obs, centers + static_cast<std::size_t>(c) * ndim, ndim);
+        if (dist < best_dist) {
+            best = c;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+struct alignas(64) ThreadState {
+    std::vector<double> sums;
+    std::vector<int> counts;
+    int changed = 0;
+};
+
+// Returns the number of observations that changed clusters in this iteration.
+int iterate(const BaseParent& mat, int ncenters, double* centers, int* clusters, int nthreads) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    std::vector<ThreadState> states(nthreads);
+
+    auto worker = [&](int t, int start, int length) -> void {
+        auto& state = states[t];
+        state.sums.assign(static_cast<std::size_t>(ncenters) * ndim, 0);
+        state.counts.assign(ncenters, 0);
+        auto ext = mat.create(start, length);
+
+        for (int o = start, end = start + length; o < end; ++o) {
+            auto ptr = ext->get();
+            int best = closest(ptr, centers, ncenters, ndim);
+            if (best != clusters[o]) {
+                clusters[o] = best;
+                ++state.changed;
+            }
+
+            auto sptr = state.sums.data() + static_cast<std::size_t>(best) * ndim;
+            for (int d = 0; d < ndim; ++d) {
+                sptr[d] += ptr[d];
+            }
+            ++state.counts[best];
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    int per_thread = nobs / nthreads + (nobs % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        int start = std::min(nobs, t * per_thread);
+        int length = std::min(nobs - start, per_thread);
+        workers.emplace_back(worker, t, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    for (int stride = 1; stride < nthreads; stride *= 2) {
+        for (int t = 0; t + stride < nthreads; t += 2 * stride) {
+            auto& left = states[t];
+            const auto& right = states[t + stride];
+            for (std::size_t i = 0, end = left.sums.size(); i < end; ++i) {
+                left.sums[i] += right.sums[i];
+            }
+            for (int c = 0; c < ncenters; ++c) {
+                left.counts[c] += right.counts[c];
+            }
+            left.changed += right.changed;
+        }
+    }
+
+    // Empty clusters keep their previous centroid.
+    const auto& total = states.front();
+    for (int c = 0; c < ncenters; ++c) {
+        if (total.counts[c]) {
+            auto cptr = centers + static_cast<std::size_t>(c) * ndim;
+            auto sptr = total.sums.data() + static_cast<std::size_t>(c) * ndim;
+            for (int d = 0; d < ndim; ++d) {
+                cptr[d] = sptr[d] / total.counts[c];
+            }
+        }
+    }
+
+    return total.changed;
+}
@@ -0,0 +1,102 @@
+/* Test the centroid update in mini-batch k-means, as a possible addition to the [CppKmeans](https://github.com/LTLA/CppKmeans) library.
+ * In each iteration, we extract a small batch of observations through the Matrix interface (as in `devirtualize.cpp`) and assign each of them to the closest centroid.
+ * Each centroid is then moved towards its assigned observations with a per-centroid learning rate of `1 / count`,
+ * where `count` is the total number of observations assigned to that centroid across all iterations so far.
+ * Only the current batch needs to be held in memory, so this works with matrices that are backed by files or that are too large to fit in memory.
+ * Batches can be sequential (wrapping around at the end of the dataset) or randomly sampled, which is why the extractor supports random access via `get(i)`.
+ *
+ * The question is whether the update in `move_center()` is vectorized, given that it does not involve any reduction.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the loop is not vectorized at all, as the "very cheap" cost model at `-O2` does not allow for a scalar epilogue.
+ * At `-O3`, we get `subpd`/`mulpd`/`addpd` on pairs of values, after a runtime check that `center` and `obs` do not overlap.
+ * Adding `__restrict__` does not help at `-O2`, so this is an example of a loop where `-O3` makes a difference.
+ * In practice, the number of dimensions is usually small after PCA (e.g., 10-50), so the update is cheap compared to the distance calculations for the assignment anyway.
+ */
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+int closest(const double* obs, const double* centers, int ncenters, int ndim) {
+    int best = 0;
+    double best_dist = std::numeric_limits<double>::infinity();
+    for (int c = 0; c < ncenters; ++c) {
+        double dist = squared_distance(obs, centers + static_cast<std::size_t>(c) * ndim, ndim);
+        if (dist < best_dist) {
+            best = c;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+void move_center(double* center, const double* obs, int ndim, double rate) {
+    for (int d = 0; d < ndim; ++d) {
+        center[d] += rate * (obs[d] - center[d]);
+    }
+}
+
+// 'counts' should be zero-initialized before the first call and preserved across calls, as it determines the learning rates.
+void minibatch(const BaseParent& mat, int ncenters, double* centers, std::vector<std::uint64_t>& counts, int batch_size, int iterations, bool random, std::uint64_t seed) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    if (nobs == 0) {
+        return;
+    }
+
+    auto ext = mat.create();
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> sampler(0, nobs - 1);
+    std::vector<double> batch(static_cast<std::size_t>(batch_size) * ndim);
+    std::vector<int> assignments(batch_size);
+    int next = 0;
+
+    for (int it = 0; it < iterations; ++it) {
+        // Assigning all observations in the batch before moving any centroids, so that the assignments are consistent within a batch.
+        for (int b = 0; b < batch_size; ++b) {
+            int o;
+            if (random) {
+                o = sampler(rng);
+            } else {
+                o = next;
+                next = (next + 1 == nobs ? 0 : next + 1);
+            }
+            auto bptr = batch.data() + static_cast<std::size_t>(b) * ndim;
+            std::copy_n(ext->get(o), ndim, bptr);
+            assignments[b] = closest(bptr, centers, ncenters, ndim);
+        }
+
+        for (int b = 0; b < batch_size; ++b) {
+            int c = assignments[b];
+            ++counts[c];
+            double rate = 1.0 / counts[c];
+            move_center(centers + static_cast<std::size_t>(c) * ndim, batch.data() + static_cast<std::size_t>(b) * ndim, ndim, rate);
+        }
+    }
+}
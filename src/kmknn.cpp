@@ -0,0 +1,153 @@
+/* Test the search loop of the k-means-based k-nearest neighbor (KMKNN) algorithm, based on the `knncolle::KmknnSearcher` in the [knncolle](https://github.com/knncolle/knncolle) library.
+ * Observations are first clustered by k-means (e.g., with [CppKmeans](https://github.com/LTLA/CppKmeans), which uses the same Matrix interface as in `devirtualize.cpp`).
+ * The observations in each cluster are then stored contiguously, sorted by increasing distance to the cluster centroid.
+ * For a query at distance `q2c` from a centroid and a current best distance `threshold`,
+ * the triangle inequality means that only observations with distances to the centroid in `[q2c - threshold, q2c + threshold]` need to be examined.
+ * Clusters with `q2c - threshold` greater than their furthest member can be skipped entirely.
+ *
+ * The question is whether the pruning within each cluster is cheap compared to the distance calculations that it avoids.
+ * In `search_cluster()`, the lower end of the range is found by `std::lower_bound()` on the sorted distances to the centroid,
+ * and the upper end is handled by breaking out of the scan as soon as an observation is too far from the centroid.
+ * Note that the upper bound shrinks as better neighbors are found, so we can't precompute the end of the range.
+ *
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `search_cluster()` is inlined into `find_nearest()`,
+ * and `std::lower_bound()` is inlined as a short binary search loop with one `comisd` and a branch per step.
+ * The scan loop keeps `threshold` and `upper` in xmm registers and only recomputes the latter (with one `addsd`) when a closer neighbor is found,
+ * so the early exit costs a single `comisd` per observation on top of the distance calculation.
+ * Curiously, `ndim` and the data pointer are reloaded from `this` in every iteration of the scan, along with an `imulq` to compute the offset.
+ * This is negligible compared to the distance calculation but could be avoided by copying them into local variables.
+ * As the observations are contiguous and in the same order as their distances to the centroid, the scan is a simple linear walk through memory.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double euclidean(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return std::sqrt(output);
+}
+
+class Kmknn {
+public:
+    // 'centers' and 'clusters' are the output of k-means on 'mat', e.g., from CppKmeans.
+    Kmknn(const BaseParent& mat, int ncenters, const double* centers, const int* clusters) :
+        ndim(mat.num_dimensions()),
+        centers(centers, centers + static_cast<std::size_t>(ncenters) * ndim),
+        offsets(ncenters + 1)
+    {
+        int nobs = mat.num_observations();
+        std::vector<double> store(static_cast<std::size_t>(nobs) * ndim);
+        auto ext = mat.create();
+        for (int o = 0; o < nobs; ++o) {
+            std::copy_n(ext->get(), ndim, store.data() + static_cast<std::size_t>(o) * ndim);
+        }
+
+        for (int o = 0; o < nobs; ++o) {
+            ++offsets[clusters[o] + 1];
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        std::vector<double> dist2center(nobs);
+        for (int o = 0; o < nobs; ++o) {
+            auto cptr = centers + static_cast<std::size_t>(clusters[o]) * ndim;
+            dist2center[o] = euclidean(store.data() + static_cast<std::size_t>(o) * ndim, cptr, ndim);
+        }
+
+        std::vector<int> order(nobs);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](int l, int r) -> bool {
+            if (clusters[l] == clusters[r]) {
+                return dist2center[l] < dist2center[r];
+            }
+            return clusters[l] < clusters[r];
+        });
+
+        observation_id.resize(nobs);
+        sorted_dist2center.resize(nobs);
+        data.resize(store.size());
+        for (int i = 0; i < nobs; ++i) {
+            auto o = order[i];
+            observation_id[i] = o;
+            sorted_dist2center[i] = dist2center[o];
+            std::copy_n(store.data() + static_cast<std::size_t>(o) * ndim, ndim, data.data() + static_cast<std::size_t>(i) * ndim);
+        }
+    }
+
+private:
+    int ndim;
+    std::vector<double> centers;
+    std::vector<int> offsets;
+    std::vector<int> observation_id;
+    std::vector<double> sorted_dist2center;
+    std::vector<double> data;
+
+    void search_cluster(int c, const double* query, double q2c, int& best_index, double& threshold) const {
+        int start = offsets[c], end = offsets[c + 1];
+        if (start == end || q2c - threshold > sorted_dist2center[end - 1]) {
+            return;
+        }
+
+        auto first = sorted_dist2center.begin() + start;
+        auto last = sorted_dist2center.begin() + end;
+        int pos = std::lower_bound(first, last, q2c - threshold) - sorted_dist2center.begin();
+
+        double upper = q2c + threshold;
+        for (; pos < end; ++pos) {
+            if (sorted_dist2center[pos] > upper) {
+                break;
+            }
+            double dist = euclidean(query, data.data() + static_cast<std::size_t>(pos) * ndim, ndim);
+            if (dist < threshold) {
+                threshold = dist;
+                best_index = observation_id[pos];
+                upper = q2c + threshold;
+            }
+        }
+    }
+
+public:
+    int find_nearest(const double* query) const {
+        int ncenters = offsets.size() - 1;
+        std::vector<std::pair<double, int> > q2c(ncenters);
+        for (int c = 0; c < ncenters; ++c) {
+            q2c[c].first = euclidean(query, centers.data() + static_cast<std::size_t>(c) * ndim, ndim);
+            q2c[c].second = c;
+        }
+
+        // Searching the closest clusters first to get a small threshold quickly.
+        std::sort(q2c.begin(), q2c.end());
+        int best_index = -1;
+        double threshold = std::numeric_limits<double>::infinity();
+        for (const auto& qc : q2c) {
+            search_cluster(qc.second, query, qc.first, best_index, threshold);
+        }
+        return best_index;
+    }
+};
+
+int foo(const Kmknn& index, const double* query) {
+    return index.find_nearest(query);
+}
@@ -0,0 +1,140 @@
+/* Test a register-blocked micro-kernel for computing distances between many queries and many reference observations at once.
+ * This is based on a batched search mode for the brute-force searcher in the [knncolle](https://github.com/knncolle/knncolle) library,
+ * where the naive approach of looping over all references for each query rereads the entire reference set for every query.
+ * Instead, we compute squared Euclidean distances as `||q||^2 + ||r||^2 - 2 q.r` so that the bulk of the work is in the dot products,
+ * which can be computed in small tiles in the same manner as a GEMM micro-kernel.
+ *
+ * Specifically, a tile of 4 queries is packed into a "panel" where the values for each dimension are interleaved across queries.
+ * For each dimension, the micro-kernel loads 4 query values as a vector, broadcasts the value of each of 4 references,
+ * and accumulates into a 4x4 block of dot products.
+ * The question is whether the compiler keeps the 16 accumulators in registers and vectorizes across the queries.
+ * Note that this does not require any reassociation of floating-point additions, as each accumulator is still summed in the same order.
+ *
+ * With x86-64 GCC 12.2 and `--std=c++17 -O2 -march=x86-64-v3`, the inner loop of `dot_tile()` consists of one `vmovupd` for the query panel,
+ * four `vbroadcastsd` for the references and four `vfmadd231pd` into ymm registers, with no loads or stores of the accumulators.
+ * This is pretty much the textbook micro-kernel, so each reference value is loaded once per 4 queries rather than once per query.
+ * At `-O2` without `-march`, the query dimension is only partially unrolled into pairs of `mulpd`/`addpd` on xmm registers,
+ * and the accumulators are loaded from and stored to the stack on every iteration, which defeats the purpose of the blocking.
+ * So, this kernel is only worthwhile when compiled for a target with 256-bit vectors.
+ *
+ * The outer loops in `compute_distances()` walk over blocks of references that are small enough to stay in L1/L2 cache while all query panels are processed against them.
+ * Observations are extracted into a contiguous buffer through the usual Matrix interface (see `devirtualize.cpp`) once per reference block.
+ * The block size is fixed here for simplicity, but would be chosen based on the number of dimensions in practice.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+constexpr int TILE = 4;
+constexpr int REF_BLOCK = 256;
+
+// Interleaves the values of 'TILE' queries so that panel[d * TILE + i] holds dimension 'd' of query 'i'.
+void pack_queries(const double* queries, int ndim, int nquery, int start, double* panel) {
+    int end = std::min(start + TILE, nquery);
+    std::fill_n(panel, static_cast<std::size_t>(ndim) * TILE, 0.0);
+    for (int i = start; i < end; ++i) {
+        auto qptr = queries + static_cast<std::size_t>(i) * ndim;
+        for (int d = 0; d < ndim; ++d) {
+            panel[static_cast<std::size_t>(d) * TILE + (i - start)] = qptr[d];
+        }
+    }
+}
+
+void dot_tile(const double* panel, const double* refs, int ndim, double* output) {
+    const double* r0 = refs;
+    const double* r1 = r0 + ndim;
+    const double* r2 = r1 + ndim;
+    const double* r3 = r2 + ndim;
+
+    double acc[TILE][TILE] = {};
+    for (int d = 0; d < ndim; ++d) {
+        const double* q = panel + static_cast<std::size_t>(d) * TILE;
+        double x0 = r0[d], x1 = r1[d], x2 = r2[d], x3 = r3[d];
+        for (int i = 0; i < TILE; ++i) {
+            acc[0][i] += q[i] * x0;
+            acc[1][i] += q[i] * x1;
+            acc[2][i] += q[i] * x2;
+            acc[3][i] += q[i] * x3;
+        }
+    }
+
+    for (int j = 0; j < TILE; ++j) {
+        for (int i = 0; i < TILE; ++i) {
+            output[j * TILE + i] = acc[j][i];
+        }
+    }
+}
+
+double squared_norm(const double* ptr, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        output += ptr[d] * ptr[d];
+    }
+    return output;
+}
+
+// Fills 'distances' with the squared distance from each query (row) to each reference (column), in row-major order.
+void compute_distances(const BaseParent& mat, const double* queries, int nquery, std::vector<double>& distances) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    distances.resize(static_cast<std::size_t>(nquery) * nobs);
+
+    int nqtiles = (nquery + TILE - 1) / TILE;
+    std::vector<double> panels(static_cast<std::size_t>(nqtiles) * ndim * TILE);
+    std::vector<double> qnorms(static_cast<std::size_t>(nqtiles) * TILE);
+    for (int t = 0; t < nqtiles; ++t) {
+        auto pptr = panels.data() + static_cast<std::size_t>(t) * ndim * TILE;
+        pack_queries(queries, ndim, nquery, t * TILE, pptr);
+        for (int i = 0; i < TILE && t * TILE + i < nquery; ++i) {
+            qnorms[t * TILE + i] = squared_norm(queries + static_cast<std::size_t>(t * TILE + i) * ndim, ndim);
+        }
+    }
+
+    auto ext = mat.create();
+    std::vector<double> refs(static_cast<std::size_t>(REF_BLOCK) * ndim);
+    std::vector<double> rnorms(REF_BLOCK);
+    double tile[TILE * TILE];
+
+    for (int rstart = 0; rstart < nobs; rstart += REF_BLOCK) {
+        int rlen = std::min(REF_BLOCK, nobs - rstart);
+        for (int r = 0; r < rlen; ++r) {
+            auto rptr = refs.data() + static_cast<std::size_t>(r) * ndim;
+            std::copy_n(ext->get(), ndim, rptr);
+            rnorms[r] = squared_norm(rptr, ndim);
+        }
+
+        // Zero-padding the last partial tile of references, so that the micro-kernel never needs a remainder loop.
+        int rpadded = (rlen + TILE - 1) / TILE * TILE;
+        std::fill(refs.begin() + static_cast<std::size_t>(rlen) * ndim, refs.begin() + static_cast<std::size_t>(rpadded) * ndim, 0.0);
+
+        for (int t = 0; t < nqtiles; ++t) {
+            auto pptr = panels.data() + static_cast<std::size_t>(t) * ndim * TILE;
+            for (int r = 0; r < rpadded; r += TILE) {
+                dot_tile(pptr, refs.data() + static_cast<std::size_t>(r) * ndim, ndim, tile);
+
+                for (int i = 0; i < TILE && t * TILE + i < nquery; ++i) {
+                    auto drow = distances.data() + static_cast<std::size_t>(t * TILE + i) * nobs + rstart;
+                    for (int j = 0; j < TILE && r + j < rlen; ++j) {
+                        drow[r + j] = std::max(0.0, qnorms[t * TILE + i] + rnorms[r + j] - 2 * tile[j * TILE + i]);
+                    }
+                }
+            }
+        }
+    }
+}
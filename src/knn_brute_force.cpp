@@ -0,0 +1,149 @@
+/* Test the inner loop of a brute-force neighbour search, based on the `knncolle::BruteforceSearcher` in the [knncolle](https://github.com/knncolle/knncolle) library.
+ * Observations are pulled one at a time through the same kind of Matrix/MatrixExtractor interface as in `devirtualize.cpp`,
+ * and the squared Euclidean distance to the query is computed for each observation before being offered to a fixed-size max-heap of the k best so far.
+ * The question is whether the distance calculation is vectorized, and whether the extractor's `get()` is devirtualized when the exact matrix class is known.
+ *
+ * With `d2_naive()`, x86-64 GCC 12.2 at `--std=c++17 -O3 -march=x86-64-v3` vectorizes the subtractions and squares (`vsubpd`, `vmulpd` on ymm registers),
+ * but the accumulation is still done one element at a time with `vaddsd`/`vfmadd231sd`, as the compiler is not allowed to reorder floating-point additions.
+ * Only with `-ffast-math` do we get a fully vectorized loop with `vfmadd231pd`.
+ * At plain `-O2`, there is no vectorization at all.
+ *
+ * With `d2_unrolled()`, we manually use four independent accumulators, which is a reordering that we explicitly permit.
+ * This is enough for GCC to pack them into a single ymm register and use `vfmadd231pd` at `-O2 -march=x86-64-v3`, no `-ffast-math` required.
+ * Even without `-march`, we get SSE2 `subpd`/`mulpd`/`addpd` on pairs of accumulators.
+ * Note that the results are not bitwise-identical to `d2_naive()`, but this is irrelevant for neighbour search.
+ *
+ * As for devirtualization, `foo()` inlines `SimpleChild::get()` into the search loop (i.e., no indirect `call`) as `search()` is instantiated with the exact `SimpleParent` type.
+ * In `bar()`, GCC speculatively devirtualizes by comparing the vtable pointer against `SimpleChild::get()`, but otherwise falls back to an indirect call per observation.
+ * This is fine as the cost of the call is amortized over the distance calculation when there are many dimensions.
+ * The heap is only touched when an observation beats the current k-th best distance, at which point we call the out-of-line `std::__push_heap` and `std::__adjust_heap` helpers.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <utility>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+    std::unique_ptr<BaseChild> create_exact() const { return create(); }
+};
+
+class SimpleChild final : public BaseChild {
+public:
+    SimpleChild(const double* p, int d) : ptr(p), ndim(d) {}
+
+private:
+    const double* ptr;
+    int ndim;
+
+public:
+    const double* get() {
+        auto output = ptr;
+        ptr += ndim;
+        return output;
+    }
+};
+
+class SimpleParent final : public BaseParent {
+public:
+    SimpleParent(int d, int n, const double* p) : ndim(d), nobs(n), payload(p) {}
+
+private:
+    int ndim, nobs;
+    const double* payload;
+
+public:
+    int num_dimensions() const {
+        return ndim;
+    }
+
+    int num_observations() const {
+        return nobs;
+    }
+
+    std::unique_ptr<BaseChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<SimpleChild> create_exact() const {
+        return std::make_unique<SimpleChild>(payload, ndim);
+    }
+};
+
+double d2_naive(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+double d2_unrolled(const double* x, const double* y, int ndim) {
+    double acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    int d = 0;
+    for (; d + 4 <= ndim; d += 4) {
+        double delta0 = x[d] - y[d];
+        double delta1 = x[d + 1] - y[d + 1];
+        double delta2 = x[d + 2] - y[d + 2];
+        double delta3 = x[d + 3] - y[d + 3];
+        acc0 += delta0 * delta0;
+        acc1 += delta1 * delta1;
+        acc2 += delta2 * delta2;
+        acc3 += delta3 * delta3;
+    }
+    for (; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        acc0 += delta * delta;
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+// Max-heap on distance, so the worst of the current k best is at the front.
+typedef std::pair<double, int> Neighbor;
+
+template<class Parent_>
+void search(const Parent_& mat, const double* query, int k, std::vector<Neighbor>& heap) {
+    heap.clear();
+    if (k <= 0) {
+        return;
+    }
+
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    auto ext = mat.create_exact();
+
+    for (int o = 0; o < nobs; ++o) {
+        auto ptr = ext->get();
+        double dist = d2_unrolled(ptr, query, ndim);
+        if (static_cast<int>(heap.size()) < k) {
+            heap.emplace_back(dist, o);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (dist < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = Neighbor(dist, o);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+}
+
+void foo(const SimpleParent& mat, const double* query, int k, std::vector<Neighbor>& heap) {
+    search(mat, query, k, heap);
+}
+
+void bar(const BaseParent& mat, const double* query, int k, std::vector<Neighbor>& heap) {
+    search(mat, query, k, heap);
+}
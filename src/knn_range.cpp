@@ -0,0 +1,225 @@
+/* Test fixed-radius neighbor searches, based on the `search_all()` methods of the [knncolle](https://github.com/knncolle/knncolle) library.
+ * Graph construction and density estimation need all neighbors within a distance threshold of each query, and often only the number of such neighbors.
+ * So, both the brute-force search and the vantage point tree (as in `vptree.cpp`) have a count-only mode that never fills any index/distance vectors,
+ * and that can stop early once the count reaches a user-specified cap (e.g., if we only want to know whether a point has at least `cap` neighbors).
+ *
+ * For the brute-force search, we compare the squared distance to the squared threshold, so no `sqrt` is needed at all.
+ * In the tree, each node also stores the size of its left subtree.
+ * If the entire ball of the left child lies within the threshold (i.e., `dist + radius <= threshold`), the count-only mode adds the subtree size without visiting any of its nodes.
+ * This means that the count for large thresholds is much cheaper than the search that reports each neighbor.
+ *
+ * The question is whether the count-only loop in `count_brute()` is as tight as the distance calculation itself.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the distance calculation is inlined and the comparison to the threshold compiles to `comisd` followed by `sbb` into the count, i.e., no branch.
+ * The early-stop check on the cap is a single `cmp`/`jg` per observation, which is easily predicted until the cap is reached.
+ * (Both the squared threshold and the cap are reloaded from the stack in each iteration, as they were spilled around the virtual calls, but these loads should always hit in L1.)
+ * Only the virtual `get()` call remains, which we could avoid by devirtualizing as in `devirtualize.cpp`.
+ * In the tree, the tail call for the right child in `count_node()` is converted into a loop as in `vptree.cpp`, leaving a single recursive call for the left child.
+ * However, `count` is loaded from and stored to memory at every update, as it is accessed through a reference that may be modified by the recursive call.
+ * This is trivial compared to the distance calculations, but it could be avoided by returning the count from each call instead.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double squared_distance(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+/*** Brute force ***/
+
+// Returns the number of observations within 'threshold' of 'query', stopping early once 'cap' is reached.
+int count_brute(const BaseParent& mat, const double* query, double threshold, int cap) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    double threshold2 = threshold * threshold;
+    auto ext = mat.create();
+    int count = 0;
+    for (int o = 0; o < nobs && count < cap; ++o) {
+        count += (squared_distance(ext->get(), query, ndim) <= threshold2);
+    }
+    return count;
+}
+
+void find_brute(const BaseParent& mat, const double* query, double threshold, std::vector<int>& indices, std::vector<double>& distances) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    double threshold2 = threshold * threshold;
+    auto ext = mat.create();
+    indices.clear();
+    distances.clear();
+    for (int o = 0; o < nobs; ++o) {
+        double d2 = squared_distance(ext->get(), query, ndim);
+        if (d2 <= threshold2) {
+            indices.push_back(o);
+            distances.push_back(std::sqrt(d2));
+        }
+    }
+}
+
+/*** Vantage point tree ***/
+
+struct Node {
+    double radius = 0;
+    int index = 0; // index of the observation in the original dataset.
+    int left = -1; // observations within 'radius' of this node.
+    int right = -1; // observations beyond 'radius' of this node.
+    int left_size = 0; // number of observations in the left subtree.
+};
+
+class Vptree {
+public:
+    Vptree(const BaseParent& mat) : ndim(mat.num_dimensions()) {
+        int nobs = mat.num_observations();
+        std::vector<double> store(static_cast<std::size_t>(nobs) * ndim);
+        auto ext = mat.create();
+        for (int o = 0; o < nobs; ++o) {
+            std::copy_n(ext->get(), ndim, store.data() + static_cast<std::size_t>(o) * ndim);
+        }
+
+        std::vector<int> order(nobs);
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<double> distances(nobs);
+        nodes.reserve(nobs);
+        build(order.data(), 0, nobs, store, distances);
+
+        coordinates.resize(store.size());
+        for (std::size_t n = 0; n < nodes.size(); ++n) {
+            auto src = store.data() + static_cast<std::size_t>(nodes[n].index) * ndim;
+            std::copy_n(src, ndim, coordinates.data() + n * ndim);
+        }
+    }
+
+private:
+    int ndim;
+    std::vector<Node> nodes;
+    std::vector<double> coordinates;
+
+    // Using the first observation in [lower, upper) as the vantage point, for simplicity.
+    int build(int* order, int lower, int upper, const std::vector<double>& store, std::vector<double>& distances) {
+        if (lower >= upper) {
+            return -1;
+        }
+
+        int pos = nodes.size();
+        nodes.emplace_back();
+        nodes[pos].index = order[lower];
+        if (upper - lower == 1) {
+            return pos;
+        }
+
+        auto vptr = store.data() + static_cast<std::size_t>(order[lower]) * ndim;
+        for (int i = lower + 1; i < upper; ++i) {
+            distances[order[i]] = std::sqrt(squared_distance(vptr, store.data() + static_cast<std::size_t>(order[i]) * ndim, ndim));
+        }
+
+        int median = lower + 1 + (upper - lower - 1) / 2;
+        std::nth_element(order + lower + 1, order + median, order + upper, [&](int l, int r) -> bool {
+            return distances[l] < distances[r];
+        });
+
+        // Pulling everything with the same distance as the median into the left subtree, so that all of the left subtree is within 'radius'.
+        double radius = distances[order[median]];
+        auto boundary = std::partition(order + median, order + upper, [&](int i) -> bool {
+            return distances[i] <= radius;
+        });
+        int middle = boundary - order;
+
+        nodes[pos].radius = radius;
+        nodes[pos].left_size = middle - lower - 1;
+        int left = build(order, lower + 1, middle, store, distances);
+        int right = build(order, middle, upper, store, distances);
+        nodes[pos].left = left;
+        nodes[pos].right = right;
+        return pos;
+    }
+
+    void count_node(int curnode, const double* query, double threshold, int cap, int& count) const {
+        const auto& node = nodes[curnode];
+        double dist = std::sqrt(squared_distance(query, coordinates.data() + static_cast<std::size_t>(curnode) * ndim, ndim));
+        count += (dist <= threshold);
+        if (count >= cap) {
+            return;
+        }
+
+        if (node.left >= 0) {
+            if (dist + node.radius <= threshold) {
+                count += node.left_size; // entire left ball is inside the threshold.
+            } else if (dist - threshold <= node.radius) {
+                count_node(node.left, query, threshold, cap, count);
+            }
+        }
+        if (count >= cap) {
+            return;
+        }
+
+        if (node.right >= 0 && dist + threshold >= node.radius) {
+            count_node(node.right, query, threshold, cap, count);
+        }
+    }
+
+    void find_node(int curnode, const double* query, double threshold, std::vector<int>& indices, std::vector<double>& distances) const {
+        const auto& node = nodes[curnode];
+        double dist = std::sqrt(squared_distance(query, coordinates.data() + static_cast<std::size_t>(curnode) * ndim, ndim));
+        if (dist <= threshold) {
+            indices.push_back(node.index);
+            distances.push_back(dist);
+        }
+
+        if (node.left >= 0 && dist - threshold <= node.radius) {
+            find_node(node.left, query, threshold, indices, distances);
+        }
+        if (node.right >= 0 && dist + threshold >= node.radius) {
+            find_node(node.right, query, threshold, indices, distances);
+        }
+    }
+
+public:
+    // Returns the number of observations within 'threshold' of 'query', stopping early once 'cap' is reached.
+    int count_within(const double* query, double threshold, int cap) const {
+        int count = 0;
+        if (!nodes.empty() && cap > 0) {
+            count_node(0, query, threshold, cap, count);
+        }
+        return std::min(count, cap);
+    }
+
+    void find_within(const double* query, double threshold, std::vector<int>& indices, std::vector<double>& distances) const {
+        indices.clear();
+        distances.clear();
+        if (!nodes.empty()) {
+            find_node(0, query, threshold, indices, distances);
+        }
+    }
+};
+
+int foo(const BaseParent& mat, const double* query, double threshold, int cap) {
+    return count_brute(mat, query, threshold, cap);
+}
+
+int bar(const Vptree& tree, const double* query, double threshold, int cap) {
+    return tree.count_within(query, threshold, cap);
+}
@@ -0,0 +1,222 @@
+/* Test access to a neighbor search index that is memory-mapped from a flat binary file, based on the vantage point tree in `vptree.cpp`.
+ * Rebuilding the index at every process start-up is expensive, so the idea is to save the built index to disk and `mmap()` it back in later.
+ * The file consists of a fixed-size header followed by the node array and the reordered observations, all addressed by byte offsets from the start of the file.
+ * No deserialization is performed when loading, so the only cost is validation of the node array and the page faults for the parts of the index that are actually touched by the search.
+ *
+ * The question is whether the indirection through the mapped image costs anything compared to the usual `std::vector`-backed index.
+ * We read the header with `std::memcpy()` to avoid any alignment or strict aliasing issues when interpreting the raw bytes.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, this `memcpy()` is inlined as a few `movdqu`/`mov` instructions in `MappedVptree::load()`, so there is no library call.
+ * Similarly, the `memcmp()` on the magic string is reduced to a single 64-bit comparison against an immediate.
+ * The node and coordinate arrays are then accessed through plain pointers, which are computed once in `load()` and stored in the `MappedVptree` instance.
+ * The assembly for `MappedVptree::search_nn()` is effectively the same as that for `Vptree::search_nn()` in `vptree.cpp`, apart from the register allocation.
+ *
+ * Note that the writer in `save()` is responsible for placing each array at an offset that is suitably aligned for its type.
+ * `mmap()` returns page-aligned memory, so aligning the offsets within the file is sufficient to get aligned arrays in memory.
+ * Endianness and padding are fixed by the header's `version`, which should be bumped whenever the layout of `Node` or `Header` changes.
+ *
+ * The file is not trusted, so `load()` checks that all arrays lie within the file (using divisions to avoid overflow in the size calculations),
+ * and that every node's `index`, `left` and `right` are in range, with children stored after their parent so that a corrupt file cannot cause an infinite recursion.
+ * This means that the entire node array is paged in at load time, though the coordinates are still only paged in when they are touched by a search.
+ */
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <fstream>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct Node {
+    double radius;
+    std::int32_t index;
+    std::int32_t left;
+    std::int32_t right;
+    std::int32_t padding;
+};
+
+static_assert(sizeof(Node) == 24, "unexpected padding in Node");
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t ndim;
+    std::uint64_t nnodes;
+    std::uint64_t node_offset;
+    std::uint64_t coordinate_offset;
+};
+
+constexpr char MAGIC[8] = { 'V', 'P', 'T', 'R', 'E', 'E', '\0', '\0' };
+constexpr std::uint32_t VERSION = 1;
+
+inline std::uint64_t align_offset(std::uint64_t offset, std::uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// 'nodes' and 'coordinates' are assumed to come from a Vptree that was already built, see `vptree.cpp`.
+void save(const std::string& path, int ndim, const std::vector<Node>& nodes, const std::vector<double>& coordinates) {
+    Header header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.ndim = ndim;
+    header.nnodes = nodes.size();
+    header.node_offset = align_offset(sizeof(Header), alignof(Node));
+    header.coordinate_offset = align_offset(header.node_offset + nodes.size() * sizeof(Node), alignof(double));
+
+    std::vector<char> image(header.coordinate_offset + coordinates.size() * sizeof(double));
+    std::memcpy(image.data(), &header, sizeof(Header));
+    std::memcpy(image.data() + header.node_offset, nodes.data(), nodes.size() * sizeof(Node));
+    std::memcpy(image.data() + header.coordinate_offset, coordinates.data(), coordinates.size() * sizeof(double));
+
+    std::ofstream output(path, std::ios::binary);
+    output.write(image.data(), image.size());
+    if (!output) {
+        throw std::runtime_error("failed to write the index to '" + path + "'");
+    }
+}
+
+class MappedVptree {
+public:
+    MappedVptree(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open '" + path + "'");
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("failed to query the size of '" + path + "'");
+        }
+        size = info.st_size;
+
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping stays valid after the file descriptor is closed.
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("failed to map '" + path + "'");
+        }
+        base = static_cast<const char*>(mapped);
+
+        try {
+            load();
+        } catch (...) {
+            munmap(const_cast<char*>(base), size);
+            throw;
+        }
+    }
+
+    ~MappedVptree() {
+        munmap(const_cast<char*>(base), size);
+    }
+
+    MappedVptree(const MappedVptree&) = delete;
+    MappedVptree& operator=(const MappedVptree&) = delete;
+
+private:
+    const char* base;
+    std::size_t size;
+    int ndim;
+    std::size_t nnodes;
+    const Node* nodes;
+    const double* coordinates;
+
+    void load() {
+        if (size < sizeof(Header)) {
+            throw std::runtime_error("index file is too small");
+        }
+
+        Header header;
+        std::memcpy(&header, base, sizeof(Header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+            throw std::runtime_error("unrecognized index format");
+        }
+        if (header.node_offset % alignof(Node) != 0 || header.coordinate_offset % alignof(double) != 0) {
+            throw std::runtime_error("misaligned arrays in the index file");
+        }
+        if (header.ndim == 0 || header.ndim > static_cast<std::uint32_t>(std::numeric_limits<int>::max()) || header.nnodes > static_cast<std::uint64_t>(std::numeric_limits<std::int32_t>::max())) {
+            throw std::runtime_error("invalid dimensions in the index file");
+        }
+
+        // Checking the sizes by division, so that a corrupt header cannot overflow the products.
+        if (header.node_offset > size || header.nnodes > (size - header.node_offset) / sizeof(Node)) {
+            throw std::runtime_error("index file is truncated");
+        }
+        if (header.coordinate_offset > size || header.nnodes > (size - header.coordinate_offset) / sizeof(double) / header.ndim) {
+            throw std::runtime_error("index file is truncated");
+        }
+
+        ndim = header.ndim;
+        nnodes = header.nnodes;
+        nodes = reinterpret_cast<const Node*>(base + header.node_offset);
+        coordinates = reinterpret_cast<const double*>(base + header.coordinate_offset);
+
+        // Children are always stored after their parent (see `vptree.cpp`), so requiring this also guarantees that the search terminates.
+        std::int32_t n = nnodes;
+        for (std::int32_t i = 0; i < n; ++i) {
+            const auto& node = nodes[i];
+            if (node.index < 0 || node.index >= n || (node.left >= 0 && (node.left <= i || node.left >= n)) || (node.right >= 0 && (node.right <= i || node.right >= n))) {
+                throw std::runtime_error("invalid node in the index file");
+            }
+        }
+    }
+
+    static double euclidean(const double* x, const double* y, int ndim) {
+        double output = 0;
+        for (int d = 0; d < ndim; ++d) {
+            double delta = x[d] - y[d];
+            output += delta * delta;
+        }
+        return std::sqrt(output);
+    }
+
+    void search_nn(int curnode, const double* query, int& best_index, double& best_dist) const {
+        const auto& node = nodes[curnode];
+        double dist = euclidean(query, coordinates + static_cast<std::size_t>(curnode) * ndim, ndim);
+        if (dist < best_dist) {
+            best_index = node.index;
+            best_dist = dist;
+        }
+
+        if (dist < node.radius) {
+            if (node.left >= 0 && dist - best_dist <= node.radius) {
+                search_nn(node.left, query, best_index, best_dist);
+            }
+            if (node.right >= 0 && dist + best_dist >= node.radius) {
+                search_nn(node.right, query, best_index, best_dist);
+            }
+        } else {
+            if (node.right >= 0 && dist + best_dist >= node.radius) {
+                search_nn(node.right, query, best_index, best_dist);
+            }
+            if (node.left >= 0 && dist - best_dist <= node.radius) {
+                search_nn(node.left, query, best_index, best_dist);
+            }
+        }
+    }
+
+public:
+    int find_nearest(const double* query) const {
+        int best_index = -1;
+        double best_dist = std::numeric_limits<double>::infinity();
+        if (nnodes) {
+            search_nn(0, query, best_index, best_dist);
+        }
+        return best_index;
+    }
+};
+
+int foo(const MappedVptree& tree, const double* query) {
+    return tree.find_nearest(query);
+}
+
+int bar(const std::string& path, const double* query) {
+    MappedVptree tree(path);
+    return tree.find_nearest(query);
+}
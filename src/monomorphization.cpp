@@ -0,0 +1,247 @@
+/* Test a policy for choosing which core classes get their own specialization of the wrapper classes from `devirtualize_class.cpp`.
+ * Each specialization of `ActualWrapperChild<Core_>` can inline the exact core child's methods, but it also adds another copy of every wrapper method to the binary.
+ * With several wrapper layers over many core classes, this increases the instruction cache footprint to the point where it might cancel out the benefit of devirtualization.
+ *
+ * Here, the core classes that are worth specializing are listed explicitly in `SpecializedCores`, e.g., because they are the most frequently used.
+ * `make_wrapper()` checks whether `Core_` is in the list at compile time, and if not, it wraps the core as a `BaseCoreParent` instead.
+ * All unlisted core classes then share the single `ActualWrapperChild<BaseCoreParent>` specialization that uses virtual dispatch,
+ * so the number of specializations is bounded by the length of the list, regardless of how many core classes exist.
+ * The wrapper templates are also instantiated for `BaseCoreParent` and each listed class by `core_list::instantiate()`, which expands over the same list,
+ * so that the set of specializations in the binary is fixed by the list and there is no second copy of the list to keep in sync.
+ *
+ * The code size of each specialization can be reported with:
+ *
+ * ```
+ * g++ -std=c++17 -O2 -c monomorphization.cpp -o mono.o
+ * nm --size-sort --radix=d -C mono.o | grep ActualWrapper
+ * ```
+ *
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `wrapped_sum()` is 87 bytes for `Core_ = BaseCoreParent`, containing a loop with an indirect call to `get()`.
+ * For `ACoreParent` and `BCoreParent`, `wrapped_sum()` is only 19 and 27 bytes, respectively, as the loop is replaced with a single multiplication.
+ * However, each specialization also needs its own constructors, destructors, `initialize()`, vtables and `std::shared_ptr` control block, which add up to several hundred bytes.
+ * `CCoreParent` and `DCoreParent` are not in the list and do not produce any wrapper symbols of their own, as they reuse `ActualWrapperParent<BaseCoreParent>` and `ActualWrapperChild<BaseCoreParent>`.
+ * Of course, the savings are small for these toy classes, but the same approach applies to real wrapper methods that are several kilobytes each.
+ */
+
+#include <memory>
+#include <type_traits>
+
+class BaseCoreChild {
+public:
+    virtual ~BaseCoreChild() = default;
+    virtual int get() = 0;
+};
+
+class BaseCoreParent {
+public:
+    virtual ~BaseCoreParent() = default;
+    virtual std::unique_ptr<BaseCoreChild> create() const = 0;
+    std::unique_ptr<BaseCoreChild> create_exact() const { return create(); }
+};
+
+class ACoreChild final : public BaseCoreChild {
+public:
+    ACoreChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload;
+    }
+};
+
+class ACoreParent final : public BaseCoreParent {
+public:
+    ACoreParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<ACoreChild> create_exact() const {
+        return std::make_unique<ACoreChild>(my_payload);
+    }
+};
+
+class BCoreChild final : public BaseCoreChild {
+public:
+    BCoreChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload + 20;
+    }
+};
+
+class BCoreParent final : public BaseCoreParent {
+public:
+    BCoreParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<BCoreChild> create_exact() const {
+        return std::make_unique<BCoreChild>(my_payload);
+    }
+};
+
+// Rarely used core classes, which are not worth specializing.
+class CCoreChild final : public BaseCoreChild {
+public:
+    CCoreChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload * 3;
+    }
+};
+
+class CCoreParent final : public BaseCoreParent {
+public:
+    CCoreParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<CCoreChild> create_exact() const {
+        return std::make_unique<CCoreChild>(my_payload);
+    }
+};
+
+class DCoreChild final : public BaseCoreChild {
+public:
+    DCoreChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload - 7;
+    }
+};
+
+class DCoreParent final : public BaseCoreParent {
+public:
+    DCoreParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<DCoreChild> create_exact() const {
+        return std::make_unique<DCoreChild>(my_payload);
+    }
+};
+
+/*** Wrapper classes ***/
+
+class BaseWrapperChild {
+public:
+    virtual ~BaseWrapperChild() = default;
+    virtual int wrapped_sum(int n) = 0;
+};
+
+class BaseWrapperParent {
+public:
+    virtual ~BaseWrapperParent() = default;
+    virtual std::unique_ptr<BaseWrapperChild> initialize() const = 0;
+};
+
+template<class Core_>
+class ActualWrapperChild final : public BaseWrapperChild {
+public:
+    ActualWrapperChild(const Core_& core_parent) : my_core_child(core_parent.create_exact()) {}
+    int wrapped_sum(int n) {
+        int output = 0;
+        for (int i = 0; i < n; ++i) {
+            output += my_core_child->get();
+        }
+        return output;
+    }
+private:
+    decltype(std::declval<Core_>().create_exact()) my_core_child;
+};
+
+template<class Core_>
+class ActualWrapperParent final : public BaseWrapperParent {
+public:
+    ActualWrapperParent(std::shared_ptr<const Core_> core) : my_core_parent(std::move(core)) {}
+    std::unique_ptr<BaseWrapperChild> initialize() const {
+        return std::make_unique<ActualWrapperChild<Core_> >(*my_core_parent);
+    }
+private:
+    std::shared_ptr<const Core_> my_core_parent;
+};
+
+/*** Specialization policy ***/
+
+template<class Core_>
+std::shared_ptr<BaseWrapperParent> make_wrapper(std::shared_ptr<const Core_> core);
+
+template<class... Cores_>
+struct core_list {
+    template<class Core_>
+    static constexpr bool contains = (std::is_same<Core_, Cores_>::value || ...);
+
+    // Instantiates the wrappers for each listed class, plus the shared 'BaseCoreParent' fallback for all other classes.
+    static void instantiate() {
+        static_cast<void>(&make_wrapper<BaseCoreParent>);
+        (static_cast<void>(&make_wrapper<Cores_>), ...);
+    }
+};
+
+// The only core classes that get their own wrapper specializations.
+typedef core_list<ACoreParent, BCoreParent> SpecializedCores;
+
+template<class Core_>
+std::shared_ptr<BaseWrapperParent> make_wrapper(std::shared_ptr<const Core_> core) {
+    if constexpr(SpecializedCores::contains<Core_>) {
+        return std::make_shared<ActualWrapperParent<Core_> >(std::move(core));
+    } else {
+        return std::make_shared<ActualWrapperParent<BaseCoreParent> >(std::shared_ptr<const BaseCoreParent>(std::move(core)));
+    }
+}
+
+// Forces the wrappers to be emitted for exactly the classes in 'SpecializedCores', even if they are not used anywhere else in this translation unit.
+void instantiate_wrappers() {
+    SpecializedCores::instantiate();
+}
+
+int foo(const BaseWrapperParent& wparent, int n) {
+    auto wchild = wparent.initialize();
+    return wchild->wrapped_sum(n);
+}
+
+int bar(std::shared_ptr<const ACoreParent> a, std::shared_ptr<const BCoreParent> b, std::shared_ptr<const CCoreParent> c, std::shared_ptr<const DCoreParent> d, int n) {
+    return foo(*make_wrapper(std::move(a)), n) +
+        foo(*make_wrapper(std::move(b)), n) +
+        foo(*make_wrapper(std::move(c)), n) +
+        foo(*make_wrapper(std::move(d)), n);
+}
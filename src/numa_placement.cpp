@@ -0,0 +1,241 @@
+/* Test NUMA-aware placement of the flat arrays that are scanned by parallel routines like `sum()` in `thread_pool.cpp`.
+ * On a multi-socket machine, Linux places each page on the NUMA node of the thread that first writes to it.
+ * If the array is zero-initialized by the main thread (e.g., with `std::vector<double>(n)`), all pages end up on one node,
+ * and threads on the other nodes have to read everything across the interconnect.
+ *
+ * Here, `NumaArray` allocates its memory with `mmap()` so that no pages are touched at allocation time.
+ * With `Placement::FIRST_TOUCH`, each thread is pinned to a node and zero-initializes the partition of the array that it will later process,
+ * so that each partition lives on the node of the thread that reads it.
+ * With `Placement::INTERLEAVE`, the pages are distributed round-robin across all nodes with `mbind()`, which is a better choice if the access pattern is not known in advance.
+ * The topology is read from `/sys/devices/system/node`, falling back to a single node with all CPUs if that directory does not exist;
+ * in that case, no pinning or `mbind()` is performed, so this is a no-op on single-node machines.
+ * Memory-only nodes are skipped as no thread can be pinned to them, but the kernel IDs of the remaining nodes are kept for the `mbind()` mask, as the node IDs may not be contiguous.
+ * We call `mbind()` via `syscall()` to avoid a dependency on libnuma, and a failed `mmap()` throws `std::bad_alloc` like any other allocation.
+ * If `mbind()` fails (e.g., it is blocked by a seccomp filter or the kernel was built without NUMA support), we fall back to first-touch initialization,
+ * which still spreads the pages across nodes; the placement that was actually used is reported by `NumaArray::placement()`.
+ *
+ * The question is whether the first-touch initialization is preserved by the compiler, given that `mmap()` already returns zeroed memory.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the zero-filling loop in `first_touch()` is converted into a call to `memset()`, which is fine as it is still executed by the pinned thread.
+ * GCC does not know that anonymous `mmap()` memory is already zero, so it cannot remove the loop.
+ * (If it could, we would need a `volatile` write per page instead.)
+ * The loop in `partial_sum()` is a plain scalar `addsd` loop as in `nd_offset.cpp`; the point here is the bandwidth, not the instruction count.
+ */
+
+#include <vector>
+#include <thread>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct NumaTopology {
+    std::vector<int> ids; // kernel ID of each node, which may not be contiguous.
+    std::vector<std::vector<int> > cpus; // CPUs for each node.
+
+    int num_nodes() const {
+        return cpus.size();
+    }
+};
+
+// Parses a list like "0-3,8-11".
+std::vector<int> parse_cpulist(const std::string& list) {
+    std::vector<int> output;
+    std::size_t pos = 0;
+    while (pos < list.size()) {
+        std::size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        auto range = list.substr(pos, end - pos);
+        auto dash = range.find('-');
+        if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+            int first = std::stoi(range.substr(0, dash));
+            int last = (dash == std::string::npos ? first : std::stoi(range.substr(dash + 1)));
+            for (int c = first; c <= last; ++c) {
+                output.push_back(c);
+            }
+        }
+        pos = end + 1;
+    }
+    return output;
+}
+
+NumaTopology detect_topology() {
+    NumaTopology output;
+    std::vector<std::pair<int, std::vector<int> > > found;
+
+    auto dir = opendir("/sys/devices/system/node");
+    if (dir) {
+        while (auto entry = readdir(dir)) {
+            std::string name(entry->d_name);
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name[4] < '0' || name[4] > '9') {
+                continue;
+            }
+            std::ifstream handle("/sys/devices/system/node/" + name + "/cpulist");
+            std::string list;
+            if (std::getline(handle, list)) {
+                auto cpus = parse_cpulist(list);
+                if (!cpus.empty()) { // skipping memory-only nodes.
+                    found.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    std::sort(found.begin(), found.end());
+    for (auto& f : found) {
+        output.ids.push_back(f.first);
+        output.cpus.push_back(std::move(f.second));
+    }
+
+    if (output.cpus.empty()) {
+        output.ids.push_back(0);
+        std::vector<int> all(std::max(1u, std::thread::hardware_concurrency()));
+        for (int c = 0, n = all.size(); c < n; ++c) {
+            all[c] = c;
+        }
+        output.cpus.push_back(std::move(all));
+    }
+    return output;
+}
+
+// Pins the calling thread to all CPUs of 'node'. This is a no-op on single-node machines.
+void pin_to_node(const NumaTopology& topo, int node) {
+    if (topo.num_nodes() <= 1) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto c : topo.cpus[node]) {
+        CPU_SET(c, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Thread 't' is always assigned to node 't % nnodes' and processes the 't'-th contiguous partition of the array.
+template<class Function_>
+void spawn_pinned(const NumaTopology& topo, std::size_t n, int nthreads, Function_ fun) {
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    std::size_t per_thread = n / nthreads + (n % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        std::size_t start = std::min(n, t * per_thread);
+        std::size_t length = std::min(n - start, per_thread);
+        workers.emplace_back([&](int t, std::size_t start, std::size_t length) -> void {
+            pin_to_node(topo, t % topo.num_nodes());
+            fun(t, start, length);
+        }, t, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+enum class Placement { FIRST_TOUCH, INTERLEAVE };
+
+void first_touch(double* ptr, std::size_t length) {
+    for (std::size_t i = 0; i < length; ++i) {
+        ptr[i] = 0;
+    }
+}
+
+class NumaArray {
+public:
+    NumaArray(std::size_t n, const NumaTopology& topo, Placement placement, int nthreads) :
+        n(n),
+        bytes(std::max<std::size_t>(1, n) * sizeof(double)),
+        effective(placement)
+    {
+        void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        payload = static_cast<double*>(ptr);
+        if (topo.num_nodes() <= 1) {
+            return; // no need to do anything, pages will be placed on the only node as they are touched.
+        }
+
+        if (placement == Placement::INTERLEAVE) {
+            constexpr int MPOL_INTERLEAVE_ = 3; // from <numaif.h>, which we avoid including.
+            // The mask is indexed by the kernel's node IDs, not by our position in 'topo'.
+            constexpr std::size_t nbits = 8 * sizeof(unsigned long);
+            std::vector<unsigned long> mask(*std::max_element(topo.ids.begin(), topo.ids.end()) / nbits + 1);
+            for (auto id : topo.ids) {
+                mask[id / nbits] |= 1ul << (id % nbits);
+            }
+            if (syscall(SYS_mbind, payload, bytes, MPOL_INTERLEAVE_, mask.data(), mask.size() * nbits + 1, 0) != 0) {
+                effective = Placement::FIRST_TOUCH;
+            }
+        }
+
+        if (effective == Placement::FIRST_TOUCH) {
+            spawn_pinned(topo, n, nthreads, [&](int, std::size_t start, std::size_t length) -> void {
+                first_touch(payload + start, length);
+            });
+        }
+    }
+
+    ~NumaArray() {
+        munmap(payload, bytes);
+    }
+
+    NumaArray(const NumaArray&) = delete;
+    NumaArray& operator=(const NumaArray&) = delete;
+
+private:
+    std::size_t n, bytes;
+    double* payload;
+    Placement effective;
+
+public:
+    double* data() { return payload; }
+    const double* data() const { return payload; }
+    std::size_t size() const { return n; }
+
+    // Placement that was actually used, which may differ from the requested one if 'mbind()' failed.
+    Placement placement() const { return effective; }
+};
+
+double partial_sum(const double* ptr, std::size_t length) {
+    double val = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        val += ptr[i];
+    }
+    return val;
+}
+
+// Each thread reads the same partition that it initialized in 'NumaArray', so all reads are from local memory.
+double sum(const NumaArray& arr, const NumaTopology& topo, int nthreads) {
+    std::vector<double> partials(nthreads);
+    spawn_pinned(topo, arr.size(), nthreads, [&](int t, std::size_t start, std::size_t length) -> void {
+        partials[t] = partial_sum(arr.data() + start, length);
+    });
+
+    double val = 0;
+    for (auto p : partials) {
+        val += p;
+    }
+    return val;
+}
+
+double foo(const double* values, std::size_t n, int nthreads) {
+    auto topo = detect_topology();
+    NumaArray arr(n, topo, Placement::FIRST_TOUCH, nthreads);
+
+    // Filling the array with the same partitioning, so each thread only writes to pages on its own node.
+    spawn_pinned(topo, n, nthreads, [&](int, std::size_t start, std::size_t length) -> void {
+        std::copy_n(values + start, length, arr.data() + start);
+    });
+
+    return sum(arr, topo, nthreads);
+}
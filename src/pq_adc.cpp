@@ -0,0 +1,251 @@
+/* Test the distance lookups for product-quantized vectors, as a possible compressed index for the [knncolle](https://github.com/knncolle/knncolle) library.
+ * Each observation is split into `nsub` contiguous subvectors, and each subvector is replaced by the index of its closest centroid in a per-subspace codebook of 256 centroids.
+ * This means that each observation is stored in `nsub` bytes, regardless of the number of dimensions.
+ * The codebooks are trained by k-means on observations extracted through the Matrix interface (as in `devirtualize.cpp`).
+ * For each query, we compute a lookup table of the squared distances from each query subvector to each centroid in the corresponding codebook.
+ * The approximate distance to each observation is then the sum of `nsub` table lookups, i.e., asymmetric distance computation (ADC).
+ * The top candidates can optionally be re-ranked by their exact distances, using the random-access extractor to fetch the original observations.
+ *
+ * The question is whether the table lookups are vectorized.
+ * With the natural layout where each observation's codes are contiguous, `adc_rows()` sums over the subspaces for each observation.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O3 -march=x86-64-v3`, this is not vectorized as it would require reordering the floating-point additions.
+ * In `adc_blocked()`, the codes are transposed within blocks of observations so that we can add each subspace's contribution to a block of observations at once.
+ * This does not reorder any additions for a given observation, so the loop over the block is vectorized with `vaddps` on ymm registers.
+ * This happens even at `-O2 -march=x86-64-v3`, as the fixed `BLOCK` size means that no scalar epilogue is needed (and without `-march`, we get `addps` on xmm registers).
+ * However, the lookups themselves are performed with scalar loads (`movzbl` then `vmovss`) that are assembled into vectors,
+ * as the generic tuning for x86-64-v3 considers gathers to be too slow.
+ * With `-O3 -march=skylake`, we do get `vgatherqps` for the lookups in `adc_blocked()` (i.e., with 64-bit indices), but not at `-O2`.
+ * The last partial block, if any, is handled by a separate scalar loop so that the vectorized loop never needs an epilogue.
+ *
+ * The fastest implementations use 4-bit codes with 16-entry tables of 8-bit quantized distances, so that each table fits in a single SIMD register for `pshufb`.
+ * GCC 12.2 does not generate `pshufb` from the equivalent scalar loop, so this would require intrinsics.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const float* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+constexpr int NCODES = 256;
+constexpr int BLOCK = 32;
+
+float squared_distance(const float* x, const float* y, int ndim) {
+    float output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        float delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return output;
+}
+
+int closest(const float* obs, const float* centers, int ncenters, int ndim) {
+    int best = 0;
+    float best_dist = std::numeric_limits<float>::infinity();
+    for (int c = 0; c < ncenters; ++c) {
+        float dist = squared_distance(obs, centers + static_cast<std::size_t>(c) * ndim, ndim);
+        if (dist < best_dist) {
+            best = c;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+class ProductQuantizer {
+public:
+    // For simplicity, we assume that the number of dimensions is divisible by 'nsub' and that there are at least 256 observations.
+    ProductQuantizer(const BaseParent& mat, int nsub, int iterations) :
+        ndim(mat.num_dimensions()),
+        nsub(nsub),
+        subdim(ndim / nsub),
+        codebooks(static_cast<std::size_t>(nsub) * NCODES * subdim)
+    {
+        int nobs = mat.num_observations();
+        auto ext = mat.create();
+        std::vector<float> subvectors(static_cast<std::size_t>(nobs) * subdim);
+        std::vector<double> sums(static_cast<std::size_t>(NCODES) * subdim);
+        std::vector<int> counts(NCODES);
+
+        for (int s = 0; s < nsub; ++s) {
+            for (int o = 0; o < nobs; ++o) {
+                std::copy_n(ext->get(o) + s * subdim, subdim, subvectors.data() + static_cast<std::size_t>(o) * subdim);
+            }
+
+            // Lloyd's algorithm, initialized with evenly spaced observations.
+            auto book = codebooks.data() + static_cast<std::size_t>(s) * NCODES * subdim;
+            for (int c = 0; c < NCODES; ++c) {
+                auto src = subvectors.data() + static_cast<std::size_t>(c) * (nobs / NCODES) * subdim;
+                std::copy_n(src, subdim, book + static_cast<std::size_t>(c) * subdim);
+            }
+
+            for (int it = 0; it < iterations; ++it) {
+                std::fill(sums.begin(), sums.end(), 0);
+                std::fill(counts.begin(), counts.end(), 0);
+                for (int o = 0; o < nobs; ++o) {
+                    auto optr = subvectors.data() + static_cast<std::size_t>(o) * subdim;
+                    int c = closest(optr, book, NCODES, subdim);
+                    auto sptr = sums.data() + static_cast<std::size_t>(c) * subdim;
+                    for (int d = 0; d < subdim; ++d) {
+                        sptr[d] += optr[d];
+                    }
+                    ++counts[c];
+                }
+                for (int c = 0; c < NCODES; ++c) {
+                    if (counts[c]) {
+                        for (int d = 0; d < subdim; ++d) {
+                            book[static_cast<std::size_t>(c) * subdim + d] = sums[static_cast<std::size_t>(c) * subdim + d] / counts[c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    int ndim, nsub, subdim;
+    std::vector<float> codebooks;
+
+public:
+    int num_subspaces() const {
+        return nsub;
+    }
+
+    void encode(const float* obs, std::uint8_t* codes) const {
+        for (int s = 0; s < nsub; ++s) {
+            auto book = codebooks.data() + static_cast<std::size_t>(s) * NCODES * subdim;
+            codes[s] = closest(obs + s * subdim, book, NCODES, subdim);
+        }
+    }
+
+    // Fills 'codes' with 'nobs * nsub' bytes for all observations in 'mat', in the blocked layout expected by 'adc_blocked()' and 'search()'.
+    void encode_all(const BaseParent& mat, std::uint8_t* codes) const {
+        int nobs = mat.num_observations();
+        int nfull = nobs - nobs % BLOCK;
+        auto ext = mat.create();
+        std::vector<std::uint8_t> buffer(nsub);
+        for (int o = 0; o < nobs; ++o) {
+            encode(ext->get(o), buffer.data());
+            int start = (o < nfull ? o - o % BLOCK : nfull);
+            int stride = (o < nfull ? BLOCK : nobs - nfull);
+            auto bptr = codes + static_cast<std::size_t>(start) * nsub + (o - start);
+            for (int s = 0; s < nsub; ++s) {
+                bptr[s * stride] = buffer[s];
+            }
+        }
+    }
+
+    // Fills 'lut' with 'nsub * NCODES' distances, where 'lut[s * NCODES + c]' is the squared distance from the query's s-th subvector to centroid 'c'.
+    void compute_lookup(const float* query, float* lut) const {
+        for (int s = 0; s < nsub; ++s) {
+            auto book = codebooks.data() + static_cast<std::size_t>(s) * NCODES * subdim;
+            for (int c = 0; c < NCODES; ++c) {
+                lut[s * NCODES + c] = squared_distance(query + s * subdim, book + static_cast<std::size_t>(c) * subdim, subdim);
+            }
+        }
+    }
+};
+
+// 'codes' has 'nsub' contiguous bytes for each observation.
+void adc_rows(const std::uint8_t* codes, int nobs, int nsub, const float* lut, float* distances) {
+    for (int o = 0; o < nobs; ++o) {
+        auto cptr = codes + static_cast<std::size_t>(o) * nsub;
+        float dist = 0;
+        for (int s = 0; s < nsub; ++s) {
+            dist += lut[s * NCODES + cptr[s]];
+        }
+        distances[o] = dist;
+    }
+}
+
+// 'codes' is split into blocks of 'BLOCK' observations, where the codes for subspace 's' of all observations in a block are contiguous.
+// If 'nobs' is not a multiple of 'BLOCK', the last block only contains the remaining observations, i.e., the codes for each subspace are contiguous with a stride equal to the number of remaining observations.
+void adc_blocked(const std::uint8_t* codes, int nobs, int nsub, const float* lut, float* distances) {
+    int nfull = nobs - nobs % BLOCK;
+    for (int start = 0; start < nfull; start += BLOCK) {
+        float block[BLOCK] = {};
+        auto bptr = codes + static_cast<std::size_t>(start) * nsub;
+        for (int s = 0; s < nsub; ++s) {
+            auto sptr = bptr + s * BLOCK;
+            auto lptr = lut + s * NCODES;
+            for (int i = 0; i < BLOCK; ++i) {
+                block[i] += lptr[sptr[i]];
+            }
+        }
+        std::copy_n(block, BLOCK, distances + start);
+    }
+
+    int remaining = nobs - nfull;
+    if (remaining) {
+        auto bptr = codes + static_cast<std::size_t>(nfull) * nsub;
+        auto dptr = distances + nfull;
+        std::fill_n(dptr, remaining, 0);
+        for (int s = 0; s < nsub; ++s) {
+            auto sptr = bptr + s * remaining;
+            auto lptr = lut + s * NCODES;
+            for (int i = 0; i < remaining; ++i) {
+                dptr[i] += lptr[sptr[i]];
+            }
+        }
+    }
+}
+
+// Returns the 'k' closest observations by their approximate distances.
+// If 'nrerank' is positive, the top 'max(k, nrerank)' candidates are re-ranked by their exact distances before choosing the 'k' closest.
+// 'codes' should be in the blocked layout described for 'adc_blocked()', e.g., as filled by 'ProductQuantizer::encode_all()'; the row layout from 'encode()' will give wrong distances.
+std::vector<std::pair<float, int> > search(
+    const BaseParent& mat,
+    const ProductQuantizer& pq,
+    const std::uint8_t* codes,
+    const float* query,
+    int k,
+    int nrerank)
+{
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    int nsub = pq.num_subspaces();
+    std::vector<float> lut(static_cast<std::size_t>(nsub) * NCODES);
+    pq.compute_lookup(query, lut.data());
+    std::vector<float> approx(nobs);
+    adc_blocked(codes, nobs, nsub, lut.data(), approx.data());
+
+    std::vector<std::pair<float, int> > candidates;
+    candidates.reserve(nobs);
+    for (int o = 0; o < nobs; ++o) {
+        candidates.emplace_back(approx[o], o);
+    }
+    k = std::max(0, std::min(k, nobs));
+    if (nrerank <= 0) {
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+        candidates.resize(k);
+        return candidates;
+    }
+
+    nrerank = std::min(std::max(nrerank, k), nobs);
+    std::partial_sort(candidates.begin(), candidates.begin() + nrerank, candidates.end());
+    candidates.resize(nrerank);
+
+    auto ext = mat.create();
+    for (auto& cand : candidates) {
+        cand.first = squared_distance(ext->get(cand.second), query, ndim);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.resize(k);
+    return candidates;
+}
@@ -0,0 +1,277 @@
+/* Test the matrix-block products in a randomized truncated SVD, as a possible replacement for the PCA step before clustering and neighbor search.
+ * This uses the block Krylov variant of the randomized SVD, see Musco and Musco (2015) and the [IRLBA](https://github.com/LTLA/CppIrlba) library for a related approach.
+ * For a matrix `A` with observations in the rows, we start with a random Gaussian block `O` with `b` columns, compute `A * O`,
+ * and then repeatedly apply `A * A^T` to build a Krylov basis `[A * O, (A * A^T) * A * O, ...]` with `power + 1` blocks.
+ * Each block is orthonormalized before the next multiplication to avoid loss of precision.
+ * The SVD of `A` is then approximated by the SVD of the small matrix `Q^T * A`, where `Q` is an orthonormal basis for the Krylov subspace.
+ *
+ * The matrix is only accessed through `multiply()` and `multiply_transposed()`,
+ * which stream observations through the same Matrix interface as in `devirtualize.cpp`, with one extractor per thread as in `kmeans_lloyd.cpp`.
+ * So, the full matrix is never held in memory, which is important for file-backed matrices.
+ * For `multiply_transposed()`, each thread accumulates its own `ndim * b` result, which are merged with the same pairwise tree reduction as in `kmeans_lloyd.cpp`.
+ * Increasing `power` improves the accuracy for matrices with slowly decaying singular values, at the cost of two extra passes over the matrix per iteration.
+ *
+ * The question is whether the inner `axpy()` in both products is vectorized.
+ * Both products are written so that the innermost loop runs across the `b` columns of the block, which does not involve any reduction.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `axpy()` is not vectorized, as the "very cheap" cost model does not allow a scalar epilogue (see `kmeans_minibatch.cpp`).
+ * At `-O3`, we get `mulpd`/`addpd` on pairs of values after a runtime check that `x` and `y` do not overlap,
+ * and `-O3 -march=x86-64-v3` uses `vfmadd213pd` on ymm registers, followed by a `vfmadd132pd` on an xmm register and a scalar `vfmadd132sd` for the remainder.
+ * If we cannot control the optimization level, it would be better to fix `b` at compile time, e.g., as a template parameter,
+ * so that the loop can be fully unrolled and vectorized at `-O2` as in `adc_blocked()` from `pq_adc.cpp`.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create(int start, int length) const = 0;
+};
+
+void axpy(double a, const double* x, double* y, int n) {
+    for (int i = 0; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+template<class Function_>
+void parallelize(int nobs, int nthreads, Function_ fun) {
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    int per_thread = nobs / nthreads + (nobs % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        int start = std::min(nobs, t * per_thread);
+        int length = std::min(nobs - start, per_thread);
+        workers.emplace_back(fun, t, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Computes 'out = A * rhs', where 'rhs' is a row-major 'ndim * b' matrix and 'out' is a row-major 'nobs * b' matrix.
+void multiply(const BaseParent& mat, const double* rhs, int b, double* out, int nthreads) {
+    int ndim = mat.num_dimensions();
+    parallelize(mat.num_observations(), nthreads, [&](int, int start, int length) -> void {
+        auto ext = mat.create(start, length);
+        for (int o = start, end = start + length; o < end; ++o) {
+            auto ptr = ext->get();
+            auto optr = out + static_cast<std::size_t>(o) * b;
+            std::fill_n(optr, b, 0);
+            for (int d = 0; d < ndim; ++d) {
+                axpy(ptr[d], rhs + static_cast<std::size_t>(d) * b, optr, b);
+            }
+        }
+    });
+}
+
+// Computes 'out = A^T * rhs', where 'rhs' is a row-major 'nobs * b' matrix and 'out' is a row-major 'ndim * b' matrix.
+void multiply_transposed(const BaseParent& mat, const double* rhs, int b, double* out, int nthreads) {
+    int ndim = mat.num_dimensions();
+    std::size_t full = static_cast<std::size_t>(ndim) * b;
+    std::vector<std::vector<double> > partials(nthreads);
+
+    parallelize(mat.num_observations(), nthreads, [&](int t, int start, int length) -> void {
+        auto& partial = partials[t];
+        partial.resize(full);
+        auto ext = mat.create(start, length);
+        for (int o = start, end = start + length; o < end; ++o) {
+            auto ptr = ext->get();
+            auto rptr = rhs + static_cast<std::size_t>(o) * b;
+            for (int d = 0; d < ndim; ++d) {
+                axpy(ptr[d], rptr, partial.data() + static_cast<std::size_t>(d) * b, b);
+            }
+        }
+    });
+
+    for (int stride = 1; stride < nthreads; stride *= 2) {
+        for (int t = 0; t + stride < nthreads; t += 2 * stride) {
+            auto& left = partials[t];
+            const auto& right = partials[t + stride];
+            for (std::size_t i = 0; i < full; ++i) {
+                left[i] += right[i];
+            }
+        }
+    }
+    std::copy_n(partials.front().data(), full, out);
+}
+
+// Modified Gram-Schmidt on the columns of a row-major 'nrow * ncol' matrix.
+void orthonormalize(double* x, int nrow, int ncol) {
+    for (int j = 0; j < ncol; ++j) {
+        for (int k = 0; k < j; ++k) {
+            double proj = 0;
+            for (int r = 0; r < nrow; ++r) {
+                proj += x[static_cast<std::size_t>(r) * ncol + j] * x[static_cast<std::size_t>(r) * ncol + k];
+            }
+            for (int r = 0; r < nrow; ++r) {
+                x[static_cast<std::size_t>(r) * ncol + j] -= proj * x[static_cast<std::size_t>(r) * ncol + k];
+            }
+        }
+
+        double norm = 0;
+        for (int r = 0; r < nrow; ++r) {
+            norm += x[static_cast<std::size_t>(r) * ncol + j] * x[static_cast<std::size_t>(r) * ncol + j];
+        }
+        norm = std::sqrt(norm);
+        for (int r = 0; r < nrow; ++r) {
+            x[static_cast<std::size_t>(r) * ncol + j] = (norm > 0 ? x[static_cast<std::size_t>(r) * ncol + j] / norm : 0);
+        }
+    }
+}
+
+// Cyclic Jacobi eigendecomposition of a symmetric 'n * n' matrix, which is fine as 'n' is small here.
+// On return, the diagonal of 'x' contains the eigenvalues and the columns of 'vectors' contain the eigenvectors.
+void jacobi(std::vector<double>& x, std::vector<double>& vectors, int n) {
+    vectors.assign(static_cast<std::size_t>(n) * n, 0);
+    for (int i = 0; i < n; ++i) {
+        vectors[static_cast<std::size_t>(i) * n + i] = 1;
+    }
+
+    for (int sweep = 0; sweep < 100; ++sweep) {
+        double off = 0;
+        for (int p = 0; p < n; ++p) {
+            for (int q = p + 1; q < n; ++q) {
+                off += x[static_cast<std::size_t>(p) * n + q] * x[static_cast<std::size_t>(p) * n + q];
+            }
+        }
+        if (off < 1e-30) {
+            break;
+        }
+
+        for (int p = 0; p < n; ++p) {
+            for (int q = p + 1; q < n; ++q) {
+                double apq = x[static_cast<std::size_t>(p) * n + q];
+                if (apq == 0) {
+                    continue;
+                }
+                double app = x[static_cast<std::size_t>(p) * n + p], aqq = x[static_cast<std::size_t>(q) * n + q];
+                double theta = (aqq - app) / (2 * apq);
+                double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                double c = 1 / std::sqrt(t * t + 1), s = t * c;
+
+                for (int k = 0; k < n; ++k) { // rotating the columns...
+                    double xkp = x[static_cast<std::size_t>(k) * n + p], xkq = x[static_cast<std::size_t>(k) * n + q];
+                    x[static_cast<std::size_t>(k) * n + p] = c * xkp - s * xkq;
+                    x[static_cast<std::size_t>(k) * n + q] = s * xkp + c * xkq;
+                }
+                for (int k = 0; k < n; ++k) { // ... and then the rows.
+                    double xpk = x[static_cast<std::size_t>(p) * n + k], xqk = x[static_cast<std::size_t>(q) * n + k];
+                    x[static_cast<std::size_t>(p) * n + k] = c * xpk - s * xqk;
+                    x[static_cast<std::size_t>(q) * n + k] = s * xpk + c * xqk;
+                }
+                for (int k = 0; k < n; ++k) {
+                    double vkp = vectors[static_cast<std::size_t>(k) * n + p], vkq = vectors[static_cast<std::size_t>(k) * n + q];
+                    vectors[static_cast<std::size_t>(k) * n + p] = c * vkp - s * vkq;
+                    vectors[static_cast<std::size_t>(k) * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+struct SvdResults {
+    std::vector<double> d; // singular values, in decreasing order.
+    std::vector<double> u; // row-major 'nobs * rank'.
+    std::vector<double> v; // row-major 'ndim * rank'.
+};
+
+// For simplicity, we assume that 'b * (power + 1)' is no greater than the number of observations or dimensions.
+SvdResults randomized_svd(const BaseParent& mat, int rank, int b, int power, std::uint64_t seed, int nthreads) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    int nblocks = power + 1;
+    int s = b * nblocks;
+
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> normal;
+    std::vector<double> omega(static_cast<std::size_t>(ndim) * b);
+    for (auto& o : omega) {
+        o = normal(rng);
+    }
+
+    // Building the Krylov basis, one block at a time.
+    std::vector<double> krylov(static_cast<std::size_t>(nobs) * s);
+    std::vector<double> block(static_cast<std::size_t>(nobs) * b);
+    std::vector<double> tblock(static_cast<std::size_t>(ndim) * b);
+    multiply(mat, omega.data(), b, block.data(), nthreads);
+    for (int i = 0; i < nblocks; ++i) {
+        if (i) {
+            multiply_transposed(mat, block.data(), b, tblock.data(), nthreads);
+            multiply(mat, tblock.data(), b, block.data(), nthreads);
+        }
+        orthonormalize(block.data(), nobs, b);
+        for (int o = 0; o < nobs; ++o) {
+            std::copy_n(block.data() + static_cast<std::size_t>(o) * b, b, krylov.data() + static_cast<std::size_t>(o) * s + i * b);
+        }
+    }
+    orthonormalize(krylov.data(), nobs, s);
+
+    // Computing the SVD of Q^T * A via the eigendecomposition of (Q^T * A) * (Q^T * A)^T = (A^T * Q)^T * (A^T * Q).
+    std::vector<double> atq(static_cast<std::size_t>(ndim) * s);
+    multiply_transposed(mat, krylov.data(), s, atq.data(), nthreads);
+    std::vector<double> gram(static_cast<std::size_t>(s) * s);
+    for (int d = 0; d < ndim; ++d) {
+        auto aptr = atq.data() + static_cast<std::size_t>(d) * s;
+        for (int j = 0; j < s; ++j) {
+            axpy(aptr[j], aptr, gram.data() + static_cast<std::size_t>(j) * s, s);
+        }
+    }
+    std::vector<double> vectors;
+    jacobi(gram, vectors, s);
+
+    std::vector<int> order(s);
+    for (int j = 0; j < s; ++j) {
+        order[j] = j;
+    }
+    std::sort(order.begin(), order.end(), [&](int l, int r) -> bool {
+        return gram[static_cast<std::size_t>(l) * s + l] > gram[static_cast<std::size_t>(r) * s + r];
+    });
+
+    rank = std::min(rank, s);
+    SvdResults output;
+    output.d.resize(rank);
+    output.u.resize(static_cast<std::size_t>(nobs) * rank);
+    output.v.resize(static_cast<std::size_t>(ndim) * rank);
+    for (int k = 0; k < rank; ++k) {
+        int j = order[k];
+        double lambda = gram[static_cast<std::size_t>(j) * s + j];
+        double sigma = std::sqrt(std::max(lambda, 0.0));
+        output.d[k] = sigma;
+
+        for (int o = 0; o < nobs; ++o) {
+            auto qptr = krylov.data() + static_cast<std::size_t>(o) * s;
+            double val = 0;
+            for (int l = 0; l < s; ++l) {
+                val += qptr[l] * vectors[static_cast<std::size_t>(l) * s + j];
+            }
+            output.u[static_cast<std::size_t>(o) * rank + k] = val;
+        }
+
+        for (int d = 0; d < ndim; ++d) {
+            auto aptr = atq.data() + static_cast<std::size_t>(d) * s;
+            double val = 0;
+            for (int l = 0; l < s; ++l) {
+                val += aptr[l] * vectors[static_cast<std::size_t>(l) * s + j];
+            }
+            output.v[static_cast<std::size_t>(d) * rank + k] = (sigma > 0 ? val / sigma : 0);
+        }
+    }
+
+    return output;
+}
@@ -0,0 +1,214 @@
+/* Test the query descent in a forest of random projection trees, in the style of the [Annoy](https://github.com/spotify/annoy) library as used by [knncolle_annoy](https://github.com/knncolle/knncolle_annoy).
+ * Each tree recursively splits the observations by a hyperplane that is equidistant from two randomly chosen observations,
+ * until each leaf contains no more than a certain number of observations.
+ * Trees are built in parallel with one tree per thread, each with its own extractor from the Matrix interface (as in `devirtualize.cpp`).
+ * All nodes are stored in flat arrays (a node array, a hyperplane array and a leaf item array) so that they could be memory-mapped as in `mmap_index.cpp`.
+ *
+ * Each normal is scaled to unit length, so that the margin is the actual distance to the hyperplane and margins from different nodes and trees can be compared.
+ *
+ * At query time, a single priority queue is shared across all trees, as in Annoy.
+ * The near child of each node inherits the priority of its parent, while the far child is given the smaller of its parent's priority and the negative distance to the hyperplane.
+ * This means that the most promising branches of all trees are explored first, until a certain number of candidate observations have been collected.
+ * The candidates are then deduplicated and sorted by their exact distances to the query, using an extractor from the Matrix interface.
+ *
+ * The question is whether the descent through each tree is cheap.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `margin()` is inlined into `search()` but is not vectorized as it is a floating-point reduction.
+ * The same applies with `-O2 -march=x86-64-v3`, where we only get a scalar `vfmadd231ss`,
+ * so it is worth using multiple accumulators as in `float_kernels.cpp` if the number of dimensions is large.
+ * The choice of the near and far children is compiled to a branch on the sign of the margin, which is hard to predict for a query that is close to the hyperplane.
+ * Curiously, `std::min(priority, -std::abs(m))` negates the absolute value with an `andps`/`xorps` pair and then uses a `cmovbe` between the addresses of the two values, followed by a load;
+ * this is a consequence of `std::min()` returning a reference, and is harmless as both values were just spilled to the stack anyway.
+ * The priority queue operations call the out-of-line `std::__push_heap` helper, but this is only done once per node visited rather than once per dimension.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <random>
+#include <queue>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const float* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+struct Node {
+    float offset;
+    std::int32_t left; // for leaves, the start of the leaf's items.
+    std::int32_t right; // for leaves, the end of the leaf's items.
+    std::int32_t is_leaf;
+    std::int32_t hyperplane; // for internal nodes, the normal is at 'hyperplane * ndim' in 'Tree::hyperplanes'.
+};
+
+struct Tree {
+    std::vector<Node> nodes;
+    std::vector<float> hyperplanes; // one normal per internal node, so leaves do not take up any space.
+    std::vector<int> items;
+};
+
+float margin(const float* normal, float offset, const float* obs, int ndim) {
+    float output = offset;
+    for (int d = 0; d < ndim; ++d) {
+        output += normal[d] * obs[d];
+    }
+    return output;
+}
+
+class Forest {
+public:
+    Forest(const BaseParent& mat, int ntrees, int leaf_size, std::uint64_t seed) : ndim(mat.num_dimensions()), trees(ntrees) {
+        int nobs = mat.num_observations();
+        std::vector<std::thread> workers;
+        workers.reserve(ntrees);
+        for (int t = 0; t < ntrees; ++t) {
+            workers.emplace_back([&](int t) -> void {
+                auto ext = mat.create();
+                std::mt19937_64 rng(seed + t);
+                std::vector<int> indices(nobs);
+                for (int o = 0; o < nobs; ++o) {
+                    indices[o] = o;
+                }
+                build(*ext, trees[t], indices.data(), nobs, leaf_size, rng);
+            }, t);
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+private:
+    int ndim;
+    std::vector<Tree> trees;
+
+    int build(BaseChild& ext, Tree& tree, int* indices, int n, int leaf_size, std::mt19937_64& rng) {
+        int pos = tree.nodes.size();
+        tree.nodes.emplace_back();
+
+        if (n <= leaf_size) {
+            auto& node = tree.nodes[pos];
+            node.is_leaf = 1;
+            node.left = tree.items.size();
+            tree.items.insert(tree.items.end(), indices, indices + n);
+            node.right = tree.items.size();
+            return pos;
+        }
+
+        std::uniform_int_distribution<int> chooser(0, n - 1);
+        int first = chooser(rng), second = chooser(rng);
+        auto fptr = ext.get(indices[first]);
+        std::vector<float> buffer(fptr, fptr + ndim); // copying as the next 'get()' might overwrite the extractor's buffer.
+        auto sptr = ext.get(indices[second]);
+
+        // The hyperplane normal is the unit vector along the difference between the two points, passing through their midpoint.
+        int hyperplane = tree.hyperplanes.size() / ndim;
+        tree.hyperplanes.resize(tree.hyperplanes.size() + ndim);
+        tree.nodes[pos].hyperplane = hyperplane;
+        auto normal = tree.hyperplanes.data() + static_cast<std::size_t>(hyperplane) * ndim;
+        float norm = 0;
+        for (int d = 0; d < ndim; ++d) {
+            normal[d] = buffer[d] - sptr[d];
+            norm += normal[d] * normal[d];
+        }
+        norm = std::sqrt(norm);
+        float offset = 0;
+        for (int d = 0; d < ndim; ++d) {
+            if (norm > 0) { // otherwise, the two points are identical and we fall back to an arbitrary split below.
+                normal[d] /= norm;
+            }
+            offset -= normal[d] * (buffer[d] + sptr[d]) / 2;
+        }
+        tree.nodes[pos].offset = offset;
+
+        auto boundary = std::partition(indices, indices + n, [&](int i) -> bool {
+            return margin(normal, offset, ext.get(i), ndim) < 0;
+        });
+        int nleft = boundary - indices;
+        if (nleft == 0 || nleft == n) {
+            nleft = n / 2; // all points are on one side, e.g., duplicates, so we split arbitrarily.
+        }
+
+        int left = build(ext, tree, indices, nleft, leaf_size, rng);
+        int right = build(ext, tree, indices + nleft, n - nleft, leaf_size, rng);
+        tree.nodes[pos].left = left;
+        tree.nodes[pos].right = right;
+        tree.nodes[pos].is_leaf = 0;
+        return pos;
+    }
+
+public:
+    // Collects up to 'ncandidates' observations from the most promising leaves across all trees.
+    void collect(const float* query, int ncandidates, std::vector<int>& candidates) const {
+        typedef std::pair<float, std::pair<int, int> > Entry; // (priority, (tree, node)), where a larger priority is better.
+        std::priority_queue<Entry> queue;
+        for (int t = 0, ntrees = trees.size(); t < ntrees; ++t) {
+            queue.emplace(std::numeric_limits<float>::infinity(), std::make_pair(t, 0));
+        }
+
+        candidates.clear();
+        while (!queue.empty() && static_cast<int>(candidates.size()) < ncandidates) {
+            auto top = queue.top();
+            queue.pop();
+            const auto& tree = trees[top.second.first];
+            int current = top.second.second;
+            float priority = top.first;
+
+            // Descending to a leaf, adding the sibling at each step to the queue.
+            while (!tree.nodes[current].is_leaf) {
+                const auto& node = tree.nodes[current];
+                float m = margin(tree.hyperplanes.data() + static_cast<std::size_t>(node.hyperplane) * ndim, node.offset, query, ndim);
+                int near = (m < 0 ? node.left : node.right);
+                int far = (m < 0 ? node.right : node.left);
+                queue.emplace(std::min(priority, -std::abs(m)), std::make_pair(top.second.first, far));
+                current = near;
+            }
+
+            const auto& leaf = tree.nodes[current];
+            candidates.insert(candidates.end(), tree.items.begin() + leaf.left, tree.items.begin() + leaf.right);
+        }
+
+        // Removing duplicates from different trees.
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    // Reports the 'k' candidates that are closest to the query, as (squared distance, index) pairs sorted by increasing distance.
+    void search(const float* query, int ncandidates, int k, BaseChild& ext, std::vector<int>& candidates, std::vector<std::pair<float, int> >& neighbors) const {
+        collect(query, ncandidates, candidates);
+
+        neighbors.clear();
+        neighbors.reserve(candidates.size());
+        for (auto c : candidates) {
+            auto ptr = ext.get(c);
+            float dist = 0;
+            for (int d = 0; d < ndim; ++d) {
+                float delta = query[d] - ptr[d];
+                dist += delta * delta;
+            }
+            neighbors.emplace_back(dist, c);
+        }
+
+        auto nkeep = std::min<std::size_t>(std::max(0, k), neighbors.size());
+        std::partial_sort(neighbors.begin(), neighbors.begin() + nkeep, neighbors.end());
+        neighbors.resize(nkeep);
+    }
+};
+
+void foo(const Forest& forest, const BaseParent& mat, const float* query, int ncandidates, int k, std::vector<std::pair<float, int> >& neighbors) {
+    auto ext = mat.create();
+    std::vector<int> candidates;
+    forest.search(query, ncandidates, k, *ext, candidates, neighbors);
+}
@@ -0,0 +1,344 @@
+/* Test a work-stealing thread pool that could be shared by all parallel routines, instead of each routine spinning up its own `std::thread`s as in `kmeans_lloyd.cpp`.
+ * The pool creates its workers once, and each call to `parallel_for()` wakes them up to process a set of jobs, so no threads are created on the hot path.
+ * Only the first `min(njobs, nworkers)` workers are woken, each through its own condition variable, so that a small set of jobs does not wake (and then idle) the entire pool.
+ * Each worker has its own Chase-Lev deque, based on the fixed-size version with C++11 atomics from Le et al. (2013).
+ * The jobs are initially distributed evenly across the deques of the woken workers; each worker pops from the bottom of its own deque, and steals from the top of the other deques when its own is empty.
+ * As no jobs are added after submission, a worker goes back to sleep as soon as its own deque and a sweep over the other deques come up empty, rather than spinning until the last job is finished;
+ * the owner of each deque only stops once its deque is empty, so no job is left behind.
+ * The submitting thread only fills the deques while all workers are idle, which is why it can push to deques that it does not own.
+ * The callback receives the worker ID alongside the job index, so that per-worker resources (like the extractors from the Matrix interface in `devirtualize.cpp`) can be created once and indexed by worker.
+ * A nested `parallel_for()` from inside a job would otherwise deadlock on the submission lock, so each worker records its pool in a thread-local variable and nested calls are run inline.
+ *
+ * We use the pool to parallelize `sum()` from `nd_offset.cpp` by splitting the rows into fixed-size chunks.
+ * Each chunk's partial sum is stored by chunk index, not by worker, and the partial sums are added in chunk order,
+ * so the result does not depend on which worker happened to process each chunk.
+ * The same is done for `column_sums()`, which uses one extractor per worker.
+ *
+ * The question is how expensive the deque operations are, given that `pop()` is executed once per job by the owner.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the deque operations are all inlined into `ThreadPool::run()`.
+ * The `std::atomic_thread_fence(std::memory_order_seq_cst)` in `pop()` and `steal()` compiles to `lock orq $0, (%rsp)`, which GCC prefers over `mfence` as it is usually cheaper,
+ * while the release fence in `push()` compiles to nothing at all, as x86 stores are already ordered.
+ * The `compare_exchange_strong()` in `pop()` (only for the last element) and `steal()` compiles to `lock cmpxchgq`.
+ * So, each job costs one locked instruction in the common case, which is negligible if each job processes a chunk of rows rather than a single row.
+ * The user's lambda is inlined into the type-erased `invoke` thunk, so there is only one indirect call per job.
+ * In `sum()`, the per-chunk loop is the same as in `nd_offset.cpp`, with the multiplication hoisted out of the loop and the pointer incremented by the stride.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+class ChaseLevDeque {
+public:
+    // 'capacity' should be a power of 2.
+    ChaseLevDeque(std::size_t capacity = 64) : buffer(capacity), mask(capacity - 1) {}
+
+private:
+    std::vector<std::atomic<int> > buffer;
+    std::size_t mask;
+    alignas(64) std::atomic<std::int64_t> top = 0;
+    alignas(64) std::atomic<std::int64_t> bottom = 0;
+
+public:
+    static constexpr int EMPTY = -1;
+
+    // Only safe to call when no other thread is accessing the deque.
+    void reserve(std::size_t n) {
+        if (n > buffer.size()) {
+            std::size_t capacity = buffer.size();
+            while (capacity < n) {
+                capacity *= 2;
+            }
+            buffer = std::vector<std::atomic<int> >(capacity);
+            mask = capacity - 1;
+        }
+    }
+
+    // Only called by the owner, or by the submitter when all workers are idle.
+    void push(int job) {
+        auto b = bottom.load(std::memory_order_relaxed);
+        buffer[b & mask].store(job, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Only called by the owner.
+    int pop() {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return EMPTY;
+        }
+
+        int job = buffer[b & mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Last element, so we need to race against any thieves.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                job = EMPTY;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    // Called by any other worker.
+    int steal() {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return EMPTY;
+        }
+
+        int job = buffer[t & mask].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return EMPTY; // lost the race to another thief or the owner.
+        }
+        return job;
+    }
+};
+
+class ThreadPool {
+public:
+    ThreadPool(int nworkers) : deques(nworkers), wake_cvs(nworkers) {
+        workers.reserve(nworkers);
+        for (int w = 0; w < nworkers; ++w) {
+            workers.emplace_back([this](int w) -> void { run(w); }, w);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lck(state_lock);
+            stopping = true;
+        }
+        for (auto& cv : wake_cvs) {
+            cv.notify_one();
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::vector<ChaseLevDeque> deques;
+
+    std::mutex submit_lock; // only one parallel_for() at a time.
+    std::mutex state_lock;
+    std::vector<std::condition_variable> wake_cvs; // one per worker, so that only the required workers are woken.
+    std::condition_variable done_cv;
+    std::uint64_t epoch = 0;
+    int nwake = 0; // workers with IDs below this number participate in the current job set.
+    int active = 0; // number of participating workers that have not yet finished, set by the submitter.
+    bool stopping = false;
+
+    // Type-erased callback for the current job set, to avoid a heap allocation from std::function.
+    void (*invoke)(void*, int, int) = nullptr;
+    void* context = nullptr;
+
+    // Identifies the pool and worker that the current thread belongs to, if any, to detect nested calls to 'parallel_for()'.
+    inline static thread_local const ThreadPool* current_pool = nullptr;
+    inline static thread_local int current_worker = -1;
+
+    void run(int w) {
+        current_pool = this;
+        current_worker = w;
+        std::uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lck(state_lock);
+                wake_cvs[w].wait(lck, [&]() -> bool { return stopping || (epoch != seen && w < nwake); });
+                if (stopping) {
+                    return;
+                }
+                seen = epoch;
+            }
+
+            int nworkers = deques.size();
+            auto& own = deques[w];
+            while (true) {
+                int job = own.pop();
+                for (int i = 1; i < nworkers && job == ChaseLevDeque::EMPTY; ++i) {
+                    job = deques[(w + i) % nworkers].steal();
+                }
+                if (job == ChaseLevDeque::EMPTY) {
+                    break; // any remaining jobs are already being processed by other workers.
+                }
+                invoke(context, w, job);
+            }
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lck(state_lock);
+                last = (--active == 0);
+            }
+            if (last) {
+                done_cv.notify_one();
+            }
+        }
+    }
+
+public:
+    int num_workers() const {
+        return workers.size();
+    }
+
+    // Calls 'fun(w, j)' for each job 'j' in [0, njobs), where 'w' is the ID of the worker that executes the job.
+    // If this is called from inside a job of the same pool, all jobs are executed serially by the calling worker,
+    // as the other workers may be busy with (or waiting on) the outer set of jobs, and the submission lock is already held.
+    template<class Function_>
+    void parallel_for(int njobs, Function_ fun) {
+        if (njobs <= 0) {
+            return;
+        }
+
+        if (current_pool == this) {
+            for (int j = 0; j < njobs; ++j) {
+                fun(current_worker, j);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> slck(submit_lock);
+        int nparticipants = std::min<int>(njobs, deques.size());
+        int per_worker = njobs / nparticipants + (njobs % nparticipants > 0);
+        for (int w = 0; w < nparticipants; ++w) {
+            auto& dq = deques[w];
+            dq.reserve(per_worker);
+            int start = std::min(njobs, w * per_worker), end = std::min(njobs, start + per_worker);
+            for (int j = end; j > start; --j) { // pushing in reverse so that the owner pops them in order.
+                dq.push(j - 1);
+            }
+        }
+
+        invoke = [](void* ctx, int w, int j) -> void { (*static_cast<Function_*>(ctx))(w, j); };
+        context = &fun;
+
+        std::unique_lock<std::mutex> lck(state_lock);
+        ++epoch;
+        nwake = nparticipants;
+        active = nparticipants; // set here rather than by each worker, so that we also wait for any worker that has not yet woken up.
+        for (int w = 0; w < nparticipants; ++w) {
+            wake_cvs[w].notify_one();
+        }
+
+        // Waiting until all participating workers have finished with the deques, so that the next submission can safely refill them.
+        // Each worker only finishes once its own deque is empty, so all jobs have been executed at this point.
+        done_cv.wait(lck, [&]() -> bool { return active == 0; });
+    }
+};
+
+// The library-wide pool, which is created with 'nworkers' threads on the first call (or the number of hardware threads, if zero).
+ThreadPool& default_pool(int nworkers = 0) {
+    static ThreadPool pool(nworkers > 0 ? nworkers : std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+/*** Parallel sum from nd_offset.cpp ***/
+
+template<typename Size_>
+Size_ nd_offset_internal(Size_ extent, Size_ pos) {
+    return extent * pos;
+}
+
+template<typename Size_, typename... MoreArgs_>
+Size_ nd_offset_internal(Size_ extent, Size_ pos, MoreArgs_... more_args) {
+    return (pos + nd_offset_internal<Size_>(more_args...)) * extent;
+}
+
+template<typename Size_, typename First_, typename Second_, typename... Remaining_>
+Size_ nd_offset(First_ x1, First_ extent1, Second_ x2, Remaining_... remaining) {
+    return static_cast<Size_>(x1) + nd_offset_internal<Size_>(extent1, x2, remaining...);
+}
+
+constexpr int CHUNK_SIZE = 4096;
+
+double sum(ThreadPool& pool, const double* mat, int NR, int NC, int r0, int c) {
+    int nrows = std::max(0, NR - r0);
+    int nchunks = nrows / CHUNK_SIZE + (nrows % CHUNK_SIZE > 0);
+    std::vector<double> partials(nchunks);
+
+    pool.parallel_for(nchunks, [&](int, int j) -> void {
+        int start = r0 + j * CHUNK_SIZE, end = std::min(NR, start + CHUNK_SIZE);
+        double val = 0;
+        for (int r = start; r < end; ++r) {
+            val += mat[nd_offset<std::size_t>(c, NC, r)];
+        }
+        partials[j] = val;
+    });
+
+    double val = 0;
+    for (auto p : partials) {
+        val += p;
+    }
+    return val;
+}
+
+/*** Per-worker extractors ***/
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get(int i) = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+// Computes the sum of each dimension across all observations.
+std::vector<double> column_sums(ThreadPool& pool, const BaseParent& mat) {
+    int ndim = mat.num_dimensions();
+    int nobs = mat.num_observations();
+    int nchunks = nobs / CHUNK_SIZE + (nobs % CHUNK_SIZE > 0);
+    std::vector<double> partials(static_cast<std::size_t>(nchunks) * ndim);
+
+    // Creating one extractor per worker, which is reused across all jobs executed by that worker.
+    std::vector<std::unique_ptr<BaseChild> > extractors;
+    for (int w = 0, nworkers = pool.num_workers(); w < nworkers; ++w) {
+        extractors.push_back(mat.create());
+    }
+
+    pool.parallel_for(nchunks, [&](int w, int j) -> void {
+        auto& ext = extractors[w];
+        auto pptr = partials.data() + static_cast<std::size_t>(j) * ndim;
+        for (int o = j * CHUNK_SIZE, end = std::min(nobs, o + CHUNK_SIZE); o < end; ++o) {
+            auto ptr = ext->get(o);
+            for (int d = 0; d < ndim; ++d) {
+                pptr[d] += ptr[d];
+            }
+        }
+    });
+
+    std::vector<double> output(ndim);
+    for (int j = 0; j < nchunks; ++j) {
+        auto pptr = partials.data() + static_cast<std::size_t>(j) * ndim;
+        for (int d = 0; d < ndim; ++d) {
+            output[d] += pptr[d];
+        }
+    }
+    return output;
+}
+
+double foo(const double* mat, int NR, int NC, int r0, int c) {
+    return sum(default_pool(), mat, NR, NC, r0, c);
+}
+
+std::vector<double> bar(const BaseParent& mat) {
+    return column_sums(default_pool(), mat);
+}
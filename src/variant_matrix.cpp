@@ -0,0 +1,152 @@
+/* Test a closed-set alternative to the virtual `BaseParent` interface in `devirtualize.cpp`, using `std::variant` and `std::visit`.
+ * If all matrix classes are known at compile time (e.g., `AParent` and `BParent` here), we can store a pointer to any of them in a `variant_matrix<AParent, BParent>`.
+ * Each algorithm is then written once as a generic lambda that is passed to `std::visit()`, which instantiates the lambda separately for each matrix class.
+ * This means that the inner loop is always compiled with the exact class of the child, so all calls to `get()` can be inlined.
+ *
+ * Existing code that only has a `BaseParent` can use `to_variant_matrix()`, which tries a `dynamic_cast` to each class in the set.
+ * If the matrix is not one of the known classes, it returns an empty `std::optional` and the caller falls back to the virtual interface.
+ * The `dynamic_cast` is only performed once per call to the algorithm, so its cost is amortized across the entire loop.
+ *
+ * The question is whether the visited lambdas are fully inlined.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `std::visit()` in `sum()` compiles to a single `cmpb` on the variant's index followed by a branch to the code for each alternative.
+ * In each branch, the loop over `get()` is fully inlined, and as `get()` just returns a constant payload, GCC replaces the entire loop with a single `imull`.
+ * The same code is inlined into `foo()` after the call to `to_variant_matrix()`.
+ * The `operator new`/`operator delete` for the child from `create_exact()` are also removed as the child does not escape the lambda.
+ * By comparison, the fallback path in `foo()` makes an indirect call to `get()` in each iteration, as in `devirtualize.cpp`.
+ * The downside is that every algorithm is instantiated once per alternative, which increases the code size (see `monomorphization.cpp`).
+ */
+
+#include <memory>
+#include <variant>
+#include <optional>
+#include <utility>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual int get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+class AChild final : public BaseChild {
+public:
+    AChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload;
+    }
+};
+
+class AParent final : public BaseParent {
+public:
+    AParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<AChild> create_exact() const {
+        return std::make_unique<AChild>(my_payload);
+    }
+};
+
+class BChild final : public BaseChild {
+public:
+    BChild(int p) : payload(p) {}
+
+private:
+    int payload;
+
+public:
+    int get() {
+        return payload + 20;
+    }
+};
+
+class BParent final : public BaseParent {
+public:
+    BParent(int p) : my_payload(p) {}
+
+private:
+    int my_payload;
+
+public:
+    std::unique_ptr<BaseChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<BChild> create_exact() const {
+        return std::make_unique<BChild>(my_payload);
+    }
+};
+
+// Non-owning, as the matrices are usually held elsewhere.
+template<class... Parents_>
+class variant_matrix {
+public:
+    template<class Parent_>
+    variant_matrix(const Parent_& parent) : ptr(&parent) {}
+
+    // Calls 'fun(parent)' with a reference to the matrix as its exact class.
+    template<class Function_>
+    decltype(auto) visit(Function_&& fun) const {
+        return std::visit([&](auto p) -> decltype(auto) { return fun(*p); }, ptr);
+    }
+
+private:
+    std::variant<const Parents_*...> ptr;
+};
+
+template<class... Parents_>
+std::optional<variant_matrix<Parents_...> > to_variant_matrix(const BaseParent& parent) {
+    std::optional<variant_matrix<Parents_...> > output;
+    // Fold expression that stops at the first successful cast.
+    ((output.has_value() ? true : [&]() -> bool {
+        auto ptr = dynamic_cast<const Parents_*>(&parent);
+        if (ptr) {
+            output.emplace(*ptr);
+        }
+        return ptr != nullptr;
+    }()) || ...);
+    return output;
+}
+
+typedef variant_matrix<AParent, BParent> KnownMatrix;
+
+int sum(const KnownMatrix& mat, int n) {
+    return mat.visit([&](const auto& parent) -> int {
+        auto child = parent.create_exact();
+        int output = 0;
+        for (int i = 0; i < n; ++i) {
+            output += child->get();
+        }
+        return output;
+    });
+}
+
+int foo(const BaseParent& parent, int n) {
+    if (auto known = to_variant_matrix<AParent, BParent>(parent)) {
+        return sum(*known, n);
+    }
+
+    // Fallback for unknown matrix classes.
+    auto child = parent.create();
+    int output = 0;
+    for (int i = 0; i < n; ++i) {
+        output += child->get();
+    }
+    return output;
+}
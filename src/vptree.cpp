@@ -0,0 +1,156 @@
+/* Test the search loop of a vantage point tree, based on the `knncolle::VptreeSearcher` in the [knncolle](https://github.com/knncolle/knncolle) library.
+ * The tree is built from observations extracted through the same kind of Matrix interface as in `devirtualize.cpp`,
+ * and all nodes are stored in a single flat vector where the children of each node are referred to by their indices.
+ * The observations are also copied in node order, so that the coordinates for node `i` are found at `i * ndim` in a single contiguous buffer.
+ * This avoids pointer chasing through individually allocated nodes and improves locality as nodes near the top of the tree are close together in memory.
+ *
+ * The search itself is recursive, where the triangle inequality is used to skip the subtree that cannot contain anything closer than the current best distance.
+ * For simplicity, we only search for the single nearest neighbor here, but the same logic applies to the k-th best distance from a heap.
+ * The question is whether the compiler turns the second recursive call into a loop, given that it is in tail position in `search_nn()`.
+ *
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, the tail calls are indeed converted into jumps back to the top of the function (`.L13` in the output),
+ * so the far subtree is visited without growing the stack.
+ * Interestingly, GCC also inlines `search_nn()` into itself a couple of levels deep, so there are 8 remaining `call search_nn` sites for the non-tail calls.
+ * This makes the function quite large (~800 lines of assembly), which may or may not be a good trade-off for the instruction cache.
+ * The distance calculation is inlined, with `sqrtsd` used directly and a fallback to `sqrt@PLT` only to set `errno` for negative inputs.
+ * Compiling with `-fno-math-errno` removes the fallback, but we can't rely on users doing so.
+ * As the node's `radius`/`index`/`left`/`right` fields are stored next to each other,
+ * each visit only touches one cache line of the node array plus the coordinates of the vantage point.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+
+class BaseChild {
+public:
+    virtual ~BaseChild() = default;
+    virtual const double* get() = 0;
+};
+
+class BaseParent {
+public:
+    virtual ~BaseParent() = default;
+    virtual int num_dimensions() const = 0;
+    virtual int num_observations() const = 0;
+    virtual std::unique_ptr<BaseChild> create() const = 0;
+};
+
+double euclidean(const double* x, const double* y, int ndim) {
+    double output = 0;
+    for (int d = 0; d < ndim; ++d) {
+        double delta = x[d] - y[d];
+        output += delta * delta;
+    }
+    return std::sqrt(output);
+}
+
+struct Node {
+    double radius = 0;
+    int index = 0; // index of the observation in the original dataset.
+    int left = -1; // observations within 'radius' of this node.
+    int right = -1; // observations beyond 'radius' of this node.
+};
+
+class Vptree {
+public:
+    Vptree(const BaseParent& mat) : ndim(mat.num_dimensions()) {
+        int nobs = mat.num_observations();
+        std::vector<double> store(static_cast<std::size_t>(nobs) * ndim);
+        auto ext = mat.create();
+        for (int o = 0; o < nobs; ++o) {
+            std::copy_n(ext->get(), ndim, store.data() + static_cast<std::size_t>(o) * ndim);
+        }
+
+        std::vector<int> order(nobs);
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<double> distances(nobs);
+        nodes.reserve(nobs);
+        build(order.data(), 0, nobs, store, distances);
+
+        coordinates.resize(store.size());
+        for (std::size_t n = 0; n < nodes.size(); ++n) {
+            auto src = store.data() + static_cast<std::size_t>(nodes[n].index) * ndim;
+            std::copy_n(src, ndim, coordinates.data() + n * ndim);
+        }
+    }
+
+private:
+    int ndim;
+    std::vector<Node> nodes;
+    std::vector<double> coordinates;
+
+    // Using the first observation in [lower, upper) as the vantage point, for simplicity.
+    int build(int* order, int lower, int upper, const std::vector<double>& store, std::vector<double>& distances) {
+        if (lower >= upper) {
+            return -1;
+        }
+
+        int pos = nodes.size();
+        nodes.emplace_back();
+        nodes[pos].index = order[lower];
+        if (upper - lower == 1) {
+            return pos;
+        }
+
+        auto vptr = store.data() + static_cast<std::size_t>(order[lower]) * ndim;
+        for (int i = lower + 1; i < upper; ++i) {
+            distances[order[i]] = euclidean(vptr, store.data() + static_cast<std::size_t>(order[i]) * ndim, ndim);
+        }
+
+        int median = lower + 1 + (upper - lower - 1) / 2;
+        std::nth_element(order + lower + 1, order + median, order + upper, [&](int l, int r) -> bool {
+            return distances[l] < distances[r];
+        });
+
+        nodes[pos].radius = distances[order[median]];
+        int left = build(order, lower + 1, median, store, distances);
+        int right = build(order, median, upper, store, distances);
+        nodes[pos].left = left;
+        nodes[pos].right = right;
+        return pos;
+    }
+
+    void search_nn(int curnode, const double* query, int& best_index, double& best_dist) const {
+        const auto& node = nodes[curnode];
+        double dist = euclidean(query, coordinates.data() + static_cast<std::size_t>(curnode) * ndim, ndim);
+        if (dist < best_dist) {
+            best_index = node.index;
+            best_dist = dist;
+        }
+
+        if (dist < node.radius) {
+            if (node.left >= 0 && dist - best_dist <= node.radius) {
+                search_nn(node.left, query, best_index, best_dist);
+            }
+            if (node.right >= 0 && dist + best_dist >= node.radius) {
+                search_nn(node.right, query, best_index, best_dist);
+            }
+        } else {
+            if (node.right >= 0 && dist + best_dist >= node.radius) {
+                search_nn(node.right, query, best_index, best_dist);
+            }
+            if (node.left >= 0 && dist - best_dist <= node.radius) {
+                search_nn(node.left, query, best_index, best_dist);
+            }
+        }
+    }
+
+public:
+    int find_nearest(const double* query) const {
+        int best_index = -1;
+        double best_dist = std::numeric_limits<double>::infinity();
+        if (!nodes.empty()) {
+            search_nn(0, query, best_index, best_dist);
+        }
+        return best_index;
+    }
+};
+
+int foo(const Vptree& tree, const double* query) {
+    return tree.find_nearest(query);
+}
@@ -0,0 +1,328 @@
+/* Test a parallel multiplication of a wrapped matrix with a dense block of vectors, using the wrapper classes from `devirtualize_class.cpp`.
+ * This is based on the `tatami_mult::multiply()` function in the [tatami_mult](https://github.com/tatami-inc/tatami_mult) library,
+ * and is the primitive underlying PCA (see `randomized_svd.cpp`), regression and projections.
+ * Each thread processes a contiguous range of rows, which it extracts through its own child from `BaseWrapperParent::initialize()`.
+ * If the core matrix is sparse, the child extracts the non-zero values and their column indices instead, so that the work is proportional to the number of non-zeros.
+ *
+ * For dense rows, `dense_tile()` computes a 4-by-8 tile of the output from 4 rows of the matrix and 8 columns of `rhs`,
+ * so that each value loaded from `rhs` is used 4 times and each value from the matrix is used 8 times (as in `knn_blocked.cpp`).
+ * For sparse rows, `sparse_tile()` computes an 8-column tile of the output for a single row, looping over the non-zero elements.
+ * In both cases, the fixed tile size means that the accumulators can be kept in registers and no epilogue is required in the innermost loop.
+ *
+ * The question is whether the tiles are vectorized at `-O2`, given that `axpy()` in `randomized_svd.cpp` was not.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2 -march=x86-64-v3`, `sparse_tile()` uses `vbroadcastsd` and two `vfmadd231pd` on ymm registers per non-zero element,
+ * with both accumulators held in registers.
+ * For `dense_tile()`, GCC vectorizes the loop over the columns but does not unroll the loop over the rows at `-O2`,
+ * so the 4-by-8 accumulator array is kept on the stack and loaded/stored for every row and every value of `k`.
+ * Adding `#pragma GCC unroll 4` to the row loop fixes this, giving 4 `vbroadcastsd` and 8 `vfmadd231pd` with all 8 ymm accumulators in registers.
+ * Without `-march`, there are only 16 xmm registers for 16 pairs of accumulators,
+ * so both tiles fall back to a `mulpd`/`addpd` loop that keeps the accumulators on the stack, even with the pragma.
+ * (This is still vectorized, which is better than `axpy()` at `-O2`.)
+ * Columns of `rhs` that are left over after the last full tile are handled with scalar loops, which is fine if `ncols` is not much smaller than 8.
+ * The wrapper child is only called once per row via virtual dispatch, so its cost is amortized over the entire row.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <cstddef>
+
+class BaseCoreChild {
+public:
+    virtual ~BaseCoreChild() = default;
+
+    // Returns a pointer to the dense contents of row 'r', possibly in 'buffer'.
+    virtual const double* fetch(int r, double* buffer) = 0;
+
+    // Fills 'vbuffer' and 'ibuffer' with the values and column indices of the non-zero elements of row 'r', returning the number of non-zeros.
+    virtual int fetch_sparse(int r, double* vbuffer, int* ibuffer) = 0;
+};
+
+class BaseCoreParent {
+public:
+    virtual ~BaseCoreParent() = default;
+    virtual int nrow() const = 0;
+    virtual int ncol() const = 0;
+    virtual bool is_sparse() const = 0;
+    virtual std::unique_ptr<BaseCoreChild> create() const = 0;
+    std::unique_ptr<BaseCoreChild> create_exact() const { return create(); }
+};
+
+class BaseWrapperChild {
+public:
+    virtual ~BaseWrapperChild() = default;
+    virtual const double* wrapped_fetch(int r, double* buffer) = 0;
+    virtual int wrapped_fetch_sparse(int r, double* vbuffer, int* ibuffer) = 0;
+};
+
+class BaseWrapperParent {
+public:
+    virtual ~BaseWrapperParent() = default;
+    virtual int nrow() const = 0;
+    virtual int ncol() const = 0;
+    virtual bool is_sparse() const = 0;
+    virtual std::unique_ptr<BaseWrapperChild> initialize() const = 0;
+};
+
+template<class Core_>
+class ActualWrapperChild final : public BaseWrapperChild {
+public:
+    ActualWrapperChild(const Core_& core_parent) : my_core_child(core_parent.create_exact()) {}
+
+    const double* wrapped_fetch(int r, double* buffer) {
+        return my_core_child->fetch(r, buffer);
+    }
+
+    int wrapped_fetch_sparse(int r, double* vbuffer, int* ibuffer) {
+        return my_core_child->fetch_sparse(r, vbuffer, ibuffer);
+    }
+
+private:
+    decltype(std::declval<Core_>().create_exact()) my_core_child;
+};
+
+template<class Core_>
+class ActualWrapperParent final : public BaseWrapperParent {
+public:
+    ActualWrapperParent(std::shared_ptr<Core_> core) : my_core_parent(std::move(core)) {}
+
+    int nrow() const {
+        return my_core_parent->nrow();
+    }
+
+    int ncol() const {
+        return my_core_parent->ncol();
+    }
+
+    bool is_sparse() const {
+        return my_core_parent->is_sparse();
+    }
+
+    std::unique_ptr<BaseWrapperChild> initialize() const {
+        return std::make_unique<ActualWrapperChild<Core_> >(*my_core_parent);
+    }
+
+private:
+    std::shared_ptr<Core_> my_core_parent;
+};
+
+constexpr int TILE_ROWS = 4;
+constexpr int TILE_COLS = 8;
+
+// Computes the 4-by-8 tile of 'out' from the product of 4 rows (each of length 'nshared') and columns [j, j + 8) of 'rhs'.
+void dense_tile(const double* const* rows, const double* rhs, int nshared, int ncols, int j, double* out) {
+    double acc[TILE_ROWS][TILE_COLS] = {};
+    for (int k = 0; k < nshared; ++k) {
+        auto rptr = rhs + static_cast<std::size_t>(k) * ncols + j;
+#pragma GCC unroll 4
+        for (int r = 0; r < TILE_ROWS; ++r) {
+            double val = rows[r][k];
+            for (int c = 0; c < TILE_COLS; ++c) {
+                acc[r][c] += val * rptr[c];
+            }
+        }
+    }
+    for (int r = 0; r < TILE_ROWS; ++r) {
+        std::copy_n(acc[r], TILE_COLS, out + static_cast<std::size_t>(r) * ncols + j);
+    }
+}
+
+// Computes columns [j, j + 8) of a single output row from the non-zero elements of the corresponding row of the matrix.
+void sparse_tile(const double* values, const int* indices, int nnz, const double* rhs, int ncols, int j, double* out) {
+    double acc[TILE_COLS] = {};
+    for (int i = 0; i < nnz; ++i) {
+        double val = values[i];
+        auto rptr = rhs + static_cast<std::size_t>(indices[i]) * ncols + j;
+        for (int c = 0; c < TILE_COLS; ++c) {
+            acc[c] += val * rptr[c];
+        }
+    }
+    std::copy_n(acc, TILE_COLS, out + j);
+}
+
+void dense_row(const double* row, const double* rhs, int nshared, int ncols, int start, double* out) {
+    for (int j = start; j < ncols; ++j) {
+        double acc = 0;
+        for (int k = 0; k < nshared; ++k) {
+            acc += row[k] * rhs[static_cast<std::size_t>(k) * ncols + j];
+        }
+        out[j] = acc;
+    }
+}
+
+// Computes 'out = mat * rhs', where 'rhs' is a row-major 'mat.ncol() * ncols' matrix and 'out' is a row-major 'mat.nrow() * ncols' matrix.
+void multiply(const BaseWrapperParent& mat, const double* rhs, int ncols, double* out, int nthreads) {
+    int NR = mat.nrow();
+    int NC = mat.ncol();
+    bool sparse = mat.is_sparse();
+    int full_cols = (ncols / TILE_COLS) * TILE_COLS;
+
+    auto worker = [&](int start, int length) -> void {
+        auto child = mat.initialize();
+        int end = start + length;
+
+        if (sparse) {
+            std::vector<double> vbuffer(NC);
+            std::vector<int> ibuffer(NC);
+            for (int r = start; r < end; ++r) {
+                int nnz = child->wrapped_fetch_sparse(r, vbuffer.data(), ibuffer.data());
+                auto optr = out + static_cast<std::size_t>(r) * ncols;
+                for (int j = 0; j < full_cols; j += TILE_COLS) {
+                    sparse_tile(vbuffer.data(), ibuffer.data(), nnz, rhs, ncols, j, optr);
+                }
+                for (int j = full_cols; j < ncols; ++j) {
+                    double acc = 0;
+                    for (int i = 0; i < nnz; ++i) {
+                        acc += vbuffer[i] * rhs[static_cast<std::size_t>(ibuffer[i]) * ncols + j];
+                    }
+                    optr[j] = acc;
+                }
+            }
+            return;
+        }
+
+        std::vector<double> buffers(static_cast<std::size_t>(TILE_ROWS) * NC);
+        const double* rows[TILE_ROWS];
+        int r = start;
+        for (; r + TILE_ROWS <= end; r += TILE_ROWS) {
+            for (int i = 0; i < TILE_ROWS; ++i) {
+                rows[i] = child->wrapped_fetch(r + i, buffers.data() + static_cast<std::size_t>(i) * NC);
+            }
+            auto optr = out + static_cast<std::size_t>(r) * ncols;
+            for (int j = 0; j < full_cols; j += TILE_COLS) {
+                dense_tile(rows, rhs, NC, ncols, j, optr);
+            }
+            for (int i = 0; i < TILE_ROWS; ++i) {
+                dense_row(rows[i], rhs, NC, ncols, full_cols, optr + static_cast<std::size_t>(i) * ncols);
+            }
+        }
+        for (; r < end; ++r) {
+            auto row = child->wrapped_fetch(r, buffers.data());
+            dense_row(row, rhs, NC, ncols, 0, out + static_cast<std::size_t>(r) * ncols);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    int per_thread = NR / nthreads + (NR % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        int start = std::min(NR, t * per_thread);
+        int length = std::min(NR - start, per_thread);
+        workers.emplace_back(worker, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+/*** Concrete core classes ***/
+
+class DenseCoreChild final : public BaseCoreChild {
+public:
+    DenseCoreChild(const double* p, int nc) : payload(p), ncol(nc) {}
+
+private:
+    const double* payload;
+    int ncol;
+
+public:
+    const double* fetch(int r, double*) {
+        return payload + static_cast<std::size_t>(r) * ncol;
+    }
+
+    int fetch_sparse(int r, double* vbuffer, int* ibuffer) {
+        auto ptr = payload + static_cast<std::size_t>(r) * ncol;
+        int nnz = 0;
+        for (int c = 0; c < ncol; ++c) {
+            if (ptr[c]) {
+                vbuffer[nnz] = ptr[c];
+                ibuffer[nnz] = c;
+                ++nnz;
+            }
+        }
+        return nnz;
+    }
+};
+
+class DenseCoreParent final : public BaseCoreParent {
+public:
+    DenseCoreParent(int nr, int nc, const double* p) : NR(nr), NC(nc), payload(p) {}
+
+private:
+    int NR, NC;
+    const double* payload;
+
+public:
+    int nrow() const { return NR; }
+    int ncol() const { return NC; }
+    bool is_sparse() const { return false; }
+
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<DenseCoreChild> create_exact() const {
+        return std::make_unique<DenseCoreChild>(payload, NC);
+    }
+};
+
+// Compressed sparse row format.
+class SparseCoreChild final : public BaseCoreChild {
+public:
+    SparseCoreChild(const double* v, const int* i, const std::size_t* p, int nc) : values(v), indices(i), pointers(p), ncol(nc) {}
+
+private:
+    const double* values;
+    const int* indices;
+    const std::size_t* pointers;
+    int ncol;
+
+public:
+    const double* fetch(int r, double* buffer) {
+        std::fill_n(buffer, ncol, 0);
+        for (auto i = pointers[r], end = pointers[r + 1]; i < end; ++i) {
+            buffer[indices[i]] = values[i];
+        }
+        return buffer;
+    }
+
+    int fetch_sparse(int r, double* vbuffer, int* ibuffer) {
+        auto start = pointers[r];
+        int nnz = pointers[r + 1] - start;
+        std::copy_n(values + start, nnz, vbuffer);
+        std::copy_n(indices + start, nnz, ibuffer);
+        return nnz;
+    }
+};
+
+class SparseCoreParent final : public BaseCoreParent {
+public:
+    SparseCoreParent(int nr, int nc, const double* v, const int* i, const std::size_t* p) : NR(nr), NC(nc), values(v), indices(i), pointers(p) {}
+
+private:
+    int NR, NC;
+    const double* values;
+    const int* indices;
+    const std::size_t* pointers;
+
+public:
+    int nrow() const { return NR; }
+    int ncol() const { return NC; }
+    bool is_sparse() const { return true; }
+
+    std::unique_ptr<BaseCoreChild> create() const {
+        return create_exact();
+    }
+
+    std::unique_ptr<SparseCoreChild> create_exact() const {
+        return std::make_unique<SparseCoreChild>(values, indices, pointers, NC);
+    }
+};
+
+void foo(std::shared_ptr<DenseCoreParent> dense, std::shared_ptr<SparseCoreParent> sparse, const double* rhs, int ncols, double* dout, double* sout, int nthreads) {
+    ActualWrapperParent<DenseCoreParent> dparent(std::move(dense));
+    ActualWrapperParent<SparseCoreParent> sparent(std::move(sparse));
+    multiply(dparent, rhs, ncols, dout, nthreads);
+    multiply(sparent, rhs, ncols, sout, nthreads);
+}
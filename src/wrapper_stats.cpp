@@ -0,0 +1,315 @@
+/* Test a one-pass computation of per-row or per-column statistics, using the wrapper classes from `devirtualize_class.cpp`.
+ * This is based on the `tatami_stats` functions in the [tatami_stats](https://github.com/tatami-inc/tatami_stats) library,
+ * where the sums, means, variances, minima, maxima and number of non-zero values are computed together, rather than making a separate pass for each statistic.
+ *
+ * The core matrix declares whether it prefers to be extracted by row or by column, e.g., a row-major array is cheap to extract by row.
+ * If the preferred dimension is the same as the one we want statistics for, each thread extracts its own range of rows (or columns) and computes the statistics directly.
+ * Otherwise, each thread extracts its own range of the other dimension and updates running statistics for every row (or column) with each vector that it extracts.
+ * The running means and variances are updated with Welford's algorithm, and the per-thread results are then merged with the parallel formula of Chan et al. (1979),
+ * using the same pairwise tree reduction as in `kmeans_lloyd.cpp`.
+ *
+ * The question is whether the running update in `update_running()` is vectorized, given that it involves a division by the count in Welford's algorithm.
+ * As all entries of the running statistics have the same count, we compute its reciprocal once per vector in `add_running()` and multiply by it instead.
+ * With x86-64 GCC 12.2 at `--std=c++17 -O2`, `update_running()` is not vectorized due to the "very cheap" cost model (see `kmeans_minibatch.cpp`),
+ * but at least there is only a single `mulsd` instead of a `divsd` per entry.
+ * The minimum and maximum are computed with `minsd`/`maxsd` and the non-zero test uses `ucomisd`/`setp`/`cmovne`, so the loop body has no branches other than the loop condition.
+ * At `-O3 -march=x86-64-v3`, the whole update is vectorized with `vminpd`/`vmaxpd`, `vfmadd213pd` and `vcmpneqpd` for the non-zero counts.
+ * However, this only happens because all pointers are marked with `__restrict__`;
+ * without it, GCC would need runtime alias checks for every pair of the 7 arrays, which exceeds its limit (`--param vect-max-version-for-alias-checks`) and so it does not vectorize the loop at all.
+ * Without `-march`, the loop is not vectorized even at `-O3`; removing the non-zero count fixes this, so the mix of 64-bit comparisons and 32-bit counts seems to be the problem for SSE2.
+ * The direct computation in `add_direct()` uses a second pass over the extracted vector (which is already in cache) to compute the sum of squared deviations from the mean,
+ * which is more accurate than Welford's algorithm and involves no division in the loop.
+ */
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+
+class BaseCoreChild {
+public:
+    virtual ~BaseCoreChild() = default;
+
+    // Returns a pointer to the contents of row/column 'i', possibly in 'buffer'.
+    virtual const double* fetch(int i, double* buffer) = 0;
+};
+
+class BaseCoreParent {
+public:
+    virtual ~BaseCoreParent() = default;
+    virtual int nrow() const = 0;
+    virtual int ncol() const = 0;
+    virtual bool prefer_rows() const = 0;
+    virtual std::unique_ptr<BaseCoreChild> create(bool row) const = 0;
+    std::unique_ptr<BaseCoreChild> create_exact(bool row) const { return create(row); }
+};
+
+class BaseWrapperChild {
+public:
+    virtual ~BaseWrapperChild() = default;
+    virtual const double* wrapped_fetch(int i, double* buffer) = 0;
+};
+
+class BaseWrapperParent {
+public:
+    virtual ~BaseWrapperParent() = default;
+    virtual int nrow() const = 0;
+    virtual int ncol() const = 0;
+    virtual bool prefer_rows() const = 0;
+    virtual std::unique_ptr<BaseWrapperChild> initialize(bool row) const = 0;
+};
+
+template<class Core_>
+class ActualWrapperChild final : public BaseWrapperChild {
+public:
+    ActualWrapperChild(const Core_& core_parent, bool row) : my_core_child(core_parent.create_exact(row)) {}
+
+    const double* wrapped_fetch(int i, double* buffer) {
+        return my_core_child->fetch(i, buffer);
+    }
+
+private:
+    decltype(std::declval<Core_>().create_exact(true)) my_core_child;
+};
+
+template<class Core_>
+class ActualWrapperParent final : public BaseWrapperParent {
+public:
+    ActualWrapperParent(std::shared_ptr<Core_> core) : my_core_parent(std::move(core)) {}
+
+    int nrow() const {
+        return my_core_parent->nrow();
+    }
+
+    int ncol() const {
+        return my_core_parent->ncol();
+    }
+
+    bool prefer_rows() const {
+        return my_core_parent->prefer_rows();
+    }
+
+    std::unique_ptr<BaseWrapperChild> initialize(bool row) const {
+        return std::make_unique<ActualWrapperChild<Core_> >(*my_core_parent, row);
+    }
+
+private:
+    std::shared_ptr<Core_> my_core_parent;
+};
+
+struct Statistics {
+    Statistics(int n = 0) :
+        sums(n),
+        means(n),
+        variances(n), // holds the sum of squared deviations until the very end.
+        mins(n, std::numeric_limits<double>::infinity()),
+        maxs(n, -std::numeric_limits<double>::infinity()),
+        nonzeros(n),
+        count(0)
+    {}
+
+    std::vector<double> sums, means, variances, mins, maxs;
+    std::vector<int> nonzeros;
+    int count; // number of observations contributing to each entry.
+};
+
+// Computes the statistics for the single vector 'ptr' of length 'n', and stores them in entry 'i' of 'stats'.
+void add_direct(const double* ptr, int n, int i, Statistics& stats) {
+    double sum = 0, mn = std::numeric_limits<double>::infinity(), mx = -std::numeric_limits<double>::infinity();
+    int nz = 0;
+    for (int j = 0; j < n; ++j) {
+        double val = ptr[j];
+        sum += val;
+        mn = std::min(mn, val);
+        mx = std::max(mx, val);
+        nz += (val != 0);
+    }
+
+    double mean = sum / n;
+    double ss = 0;
+    for (int j = 0; j < n; ++j) {
+        double delta = ptr[j] - mean;
+        ss += delta * delta;
+    }
+
+    stats.sums[i] = sum;
+    stats.means[i] = mean;
+    stats.variances[i] = ss;
+    stats.mins[i] = mn;
+    stats.maxs[i] = mx;
+    stats.nonzeros[i] = nz;
+}
+
+// All pointers are marked as non-overlapping, otherwise GCC gives up on the number of runtime alias checks that it would need.
+void update_running(
+    const double* __restrict__ ptr,
+    int n,
+    double inv,
+    double* __restrict__ sptr,
+    double* __restrict__ mptr,
+    double* __restrict__ vptr,
+    double* __restrict__ minptr,
+    double* __restrict__ maxptr,
+    int* __restrict__ nzptr)
+{
+    for (int i = 0; i < n; ++i) {
+        double val = ptr[i];
+        sptr[i] += val;
+        double delta = val - mptr[i];
+        mptr[i] += delta * inv;
+        vptr[i] += delta * (val - mptr[i]);
+        minptr[i] = std::min(minptr[i], val);
+        maxptr[i] = std::max(maxptr[i], val);
+        nzptr[i] += (val != 0);
+    }
+}
+
+// Adds the vector 'ptr' of length 'n' to the running statistics, where 'ptr[i]' contributes to entry 'i'.
+void add_running(const double* ptr, int n, Statistics& stats) {
+    ++stats.count;
+    double inv = 1.0 / stats.count;
+    update_running(
+        ptr,
+        n,
+        inv,
+        stats.sums.data(),
+        stats.means.data(),
+        stats.variances.data(),
+        stats.mins.data(),
+        stats.maxs.data(),
+        stats.nonzeros.data()
+    );
+}
+
+// Merges the running statistics in 'right' into 'left', using Chan et al.'s formula for the sum of squared deviations.
+void merge_running(Statistics& left, const Statistics& right) {
+    if (right.count == 0) {
+        return;
+    }
+    double nl = left.count, nr = right.count;
+    double total = nl + nr;
+    for (std::size_t i = 0, n = left.sums.size(); i < n; ++i) {
+        double delta = right.means[i] - left.means[i];
+        left.means[i] += delta * nr / total;
+        left.variances[i] += right.variances[i] + delta * delta * nl * nr / total;
+        left.sums[i] += right.sums[i];
+        left.mins[i] = std::min(left.mins[i], right.mins[i]);
+        left.maxs[i] = std::max(left.maxs[i], right.maxs[i]);
+        left.nonzeros[i] += right.nonzeros[i];
+    }
+    left.count += right.count;
+}
+
+template<class Function_>
+void parallelize(int n, int nthreads, Function_ fun) {
+    std::vector<std::thread> workers;
+    workers.reserve(nthreads);
+    int per_thread = n / nthreads + (n % nthreads > 0);
+    for (int t = 0; t < nthreads; ++t) {
+        int start = std::min(n, t * per_thread);
+        int length = std::min(n - start, per_thread);
+        workers.emplace_back(fun, t, start, length);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+// Computes statistics for each row (if 'row = true') or each column, with sample variances.
+Statistics compute(const BaseWrapperParent& mat, bool row, int nthreads) {
+    int NR = mat.nrow(), NC = mat.ncol();
+    int ntarget = (row ? NR : NC);
+    int nother = (row ? NC : NR);
+
+    Statistics output;
+    if (mat.prefer_rows() == row) {
+        output = Statistics(ntarget);
+        output.count = nother;
+        parallelize(ntarget, nthreads, [&](int, int start, int length) -> void {
+            auto child = mat.initialize(row);
+            std::vector<double> buffer(nother);
+            for (int i = start, end = start + length; i < end; ++i) {
+                auto ptr = child->wrapped_fetch(i, buffer.data());
+                add_direct(ptr, nother, i, output);
+            }
+        });
+
+    } else {
+        std::vector<Statistics> partials(nthreads);
+        parallelize(nother, nthreads, [&](int t, int start, int length) -> void {
+            auto& partial = partials[t];
+            partial = Statistics(ntarget);
+            auto child = mat.initialize(!row);
+            std::vector<double> buffer(ntarget);
+            for (int j = start, end = start + length; j < end; ++j) {
+                auto ptr = child->wrapped_fetch(j, buffer.data());
+                add_running(ptr, ntarget, partial);
+            }
+        });
+
+        for (int stride = 1; stride < nthreads; stride *= 2) {
+            for (int t = 0; t + stride < nthreads; t += 2 * stride) {
+                merge_running(partials[t], partials[t + stride]);
+            }
+        }
+        output = std::move(partials.front());
+    }
+
+    for (auto& v : output.variances) {
+        v = (output.count > 1 ? v / (output.count - 1) : std::numeric_limits<double>::quiet_NaN());
+    }
+    return output;
+}
+
+/*** Concrete core class ***/
+
+class DenseRowCoreChild final : public BaseCoreChild {
+public:
+    DenseRowCoreChild(const double* p, int nr, int nc, bool r) : payload(p), NR(nr), NC(nc), row(r) {}
+
+private:
+    const double* payload;
+    int NR, NC;
+    bool row;
+
+public:
+    const double* fetch(int i, double* buffer) {
+        if (row) {
+            return payload + static_cast<std::size_t>(i) * NC;
+        }
+        for (int r = 0; r < NR; ++r) {
+            buffer[r] = payload[static_cast<std::size_t>(r) * NC + i];
+        }
+        return buffer;
+    }
+};
+
+class DenseRowCoreParent final : public BaseCoreParent {
+public:
+    DenseRowCoreParent(int nr, int nc, const double* p) : NR(nr), NC(nc), payload(p) {}
+
+private:
+    int NR, NC;
+    const double* payload;
+
+public:
+    int nrow() const { return NR; }
+    int ncol() const { return NC; }
+    bool prefer_rows() const { return true; }
+
+    std::unique_ptr<BaseCoreChild> create(bool row) const {
+        return create_exact(row);
+    }
+
+    std::unique_ptr<DenseRowCoreChild> create_exact(bool row) const {
+        return std::make_unique<DenseRowCoreChild>(payload, NR, NC, row);
+    }
+};
+
+void foo(std::shared_ptr<DenseRowCoreParent> core, int nthreads, Statistics& rowstats, Statistics& colstats) {
+    ActualWrapperParent<DenseRowCoreParent> parent(std::move(core));
+    rowstats = compute(parent, true, nthreads);
+    colstats = compute(parent, false, nthreads);
+}